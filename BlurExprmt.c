@@ -1,18 +1,34 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "Utils.h"
 #include "Picture.h"
+#include "PicKernels.h"
 #include "PicProcess.h"
+#include "ThreadPool.h"
 
 #define NUM_TEST_RUNS 200
+#define EXPRMT_HIGH_WATER 4096
+#define BACKGROUND_BLURS 10
+#define THROUGHPUT_JOBS 200000
+#define REPEATED_BLURS 10
 #define BILLION 1000000000
 #define PRINT_TIME(label, time) printf("%s Time Taken: %lu.%09lus\n", label, time / BILLION, time % BILLION)
 
 typedef void blur_func(struct picture *pic);
 
 static bool test_blur_func(blur_func func, char *pic_path, char *save_path, char *label, bool save);
+static void compare_thread_pool_backends(char *pic_path, char *save_path);
+static void compare_pic_kernels(char *pic_path, char *save_path);
+static void measure_priority_latency(char *pic_path);
+static void measure_backend_throughput(void);
+static void *empty_job(void *args);
+static void repeated_blur_picture(struct picture *pic);
+static void equivalent_gaussian_blur_picture(struct picture *pic);
+static void *blur_job(void *vpic);
+static void *invert_job(void *vpic);
 
 // ---------- MAIN PROGRAM ---------- \\
 
@@ -30,21 +46,204 @@ static bool test_blur_func(blur_func func, char *pic_path, char *save_path, char
 
     char *prefix = "blur_";
     char save_path[strlen(prefix) + strlen(file_name) + 1];
-    *save_path = 0;
-    strncat(save_path, prefix, strlen(prefix));
-    strncat(save_path, file_name, strlen(file_name));
+    snprintf(save_path, sizeof(save_path), "%s%s", prefix, file_name);
     
-    test_blur_func(&blur_picture, pic_path, save_path, "Sequential", false);
-    test_blur_func(&parallel_blur_picture, pic_path, save_path, "Pixel by pixel", false);
+    test_blur_func(&naive_blur_picture, pic_path, save_path, "Sequential", false);
+    test_blur_func(&blur_picture, pic_path, save_path, "Sequential box blur", false);
+    test_blur_func(&parallel_blur_picture, pic_path, save_path, "Parallel box blur", false);
+    test_blur_func(&parallel_tile_blur_picture, pic_path, save_path, "Automatic tiles", false);
+    test_blur_func(&parallel_pixel_blur_picture, pic_path, save_path, "Pixel by pixel", false);
     test_blur_func(&parallel_row_blur_picture, pic_path, save_path, "Row by row", false);
     test_blur_func(&parallel_column_blur_picture, pic_path, save_path, "Column by column", false);
     test_blur_func(&parallel_v_half_sector_blur_picture, pic_path, save_path, "Vertical half segments", false);
     test_blur_func(&parallel_h_half_sector_blur_picture, pic_path, save_path, "Horizontal half segments", false);
     test_blur_func(&parallel_quarter_sector_blur_picture, pic_path, save_path, "Quarter segments", false);
+    test_blur_func(&repeated_blur_picture, pic_path, save_path, "Ten box blurs", false);
+    test_blur_func(&equivalent_gaussian_blur_picture, pic_path, save_path, "Equivalent gaussian blur", false);
+
+    compare_pic_kernels(pic_path, save_path);
+    compare_thread_pool_backends(pic_path, save_path);
+    measure_priority_latency(pic_path);
+    measure_backend_throughput();
     
     return EXIT_SUCCESS;
   }
 
+  /* Times invert, grayscale and blur with each set of kernels this CPU can run,
+     then goes back to the default set. */
+  static void compare_pic_kernels(char *pic_path, char *save_path) {
+    const char *names[] = { "scalar", "sse2", "avx2" };
+    const char *default_name = get_pic_kernels()->name;
+
+    for (int k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+      if (!select_pic_kernels(names[k])) {
+        printf("Kernels (%s) not supported on this CPU\n\n", names[k]);
+        continue;
+      }
+
+      char label[64];
+      snprintf(label, sizeof(label), "Invert (%s)", names[k]);
+      test_blur_func(&invert_picture, pic_path, save_path, label, false);
+      snprintf(label, sizeof(label), "Grayscale (%s)", names[k]);
+      test_blur_func(&grayscale_picture, pic_path, save_path, label, false);
+      snprintf(label, sizeof(label), "Box blur (%s)", names[k]);
+      test_blur_func(&blur_picture, pic_path, save_path, label, false);
+    }
+
+    select_pic_kernels(default_name);
+  }
+
+  /* Reruns the finest and a coarse grained blur on a dedicated pool for each
+     thread pool backend, so the scheduling overhead of each can be compared,
+     and dumps the pool's stats as JSON. */
+  static void compare_thread_pool_backends(char *pic_path, char *save_path) {
+    thread_pool_backend_t backends[] = { THREAD_POOL_MUTEX_QUEUE, THREAD_POOL_WORK_STEALING, THREAD_POOL_MPMC_RING };
+
+    for (int b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+      thread_pool_t tpool;
+      thread_pool_init_backend(&tpool, thread_pool_default_threads(), EXPRMT_HIGH_WATER, backends[b]);
+      thread_pool_set_alloc_counting(&tpool, true);
+      set_picture_thread_pool(&tpool);
+
+      const char *name = thread_pool_backend_name(backends[b]);
+      char pixel_label[64];
+      char row_label[64];
+      snprintf(pixel_label, sizeof(pixel_label), "Pixel by pixel (%s)", name);
+      snprintf(row_label, sizeof(row_label), "Row by row (%s)", name);
+
+      test_blur_func(&parallel_pixel_blur_picture, pic_path, save_path, pixel_label, false);
+      test_blur_func(&parallel_row_blur_picture, pic_path, save_path, row_label, false);
+      printf("Job argument allocations avoided (%s): %ld\n", name, thread_pool_avoided_allocs(&tpool));
+
+      thread_pool_stats_t *stats = thread_pool_stats(&tpool);
+      printf("Thread pool stats (%s): ", name);
+      thread_pool_stats_json(stdout, stats);
+      printf("\n");
+      free(stats);
+
+      set_picture_thread_pool(NULL);
+      thread_pool_destroy(&tpool);
+    }
+  }
+
+  /* Times an invert submitted behind BACKGROUND_BLURS whole-picture blurs, once
+     at normal and once at high priority, to show the latency a cheap request
+     sees under mixed load. */
+  static void measure_priority_latency(char *pic_path) {
+    thread_pool_priority_t priorities[] = { THREAD_POOL_PRIORITY_NORMAL, THREAD_POOL_PRIORITY_HIGH };
+    const char *labels[] = { "Invert behind blurs (normal priority)", "Invert behind blurs (high priority)" };
+    struct picture pic;
+
+    if (!init_picture_from_file(&pic, pic_path)) {
+      return;
+    }
+
+    thread_pool_t tpool;
+    thread_pool_init(&tpool, thread_pool_default_threads(), EXPRMT_HIGH_WATER);
+    set_picture_thread_pool(&tpool);
+
+    for (int p = 0; p < sizeof(priorities) / sizeof(priorities[0]); p++) {
+      struct picture blur_pics[BACKGROUND_BLURS];
+      thread_pool_future_t *blurs[BACKGROUND_BLURS];
+      thread_pool_job_opts_t background = { THREAD_POOL_PRIORITY_NORMAL, NULL };
+      thread_pool_job_opts_t request = { priorities[p], NULL };
+
+      for (int i = 0; i < BACKGROUND_BLURS; i++) {
+        init_picture_copy(&blur_pics[i], &pic);
+        blurs[i] = thread_pool_submit_opts(&tpool, &blur_job, &blur_pics[i], NULL, 0, &background);
+      }
+
+      struct picture invert_pic;
+      init_picture_copy(&invert_pic, &pic);
+
+      struct timespec start;
+      struct timespec end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      thread_pool_future_t *invert = thread_pool_submit_opts(&tpool, &invert_job, &invert_pic, NULL, 0, &request);
+      thread_pool_future_wait(invert);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      thread_pool_future_release(invert);
+
+      u_int64_t diff_ns = BILLION * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
+      printf("%s:\n", labels[p]);
+      PRINT_TIME("Latency", diff_ns);
+      printf("\n");
+
+      for (int i = 0; i < BACKGROUND_BLURS; i++) {
+        thread_pool_future_wait(blurs[i]);
+        thread_pool_future_release(blurs[i]);
+        clear_picture(&blur_pics[i]);
+      }
+      clear_picture(&invert_pic);
+    }
+
+    set_picture_thread_pool(NULL);
+    thread_pool_destroy(&tpool);
+    clear_picture(&pic);
+  }
+
+  /* Reports how many empty jobs per second each backend gets through when
+     submitted from outside the pool, for 1, 2, 4, ... workers up to the
+     default number, so the backend can be picked per host. */
+  static void measure_backend_throughput(void) {
+    thread_pool_backend_t backends[] = { THREAD_POOL_MUTEX_QUEUE, THREAD_POOL_WORK_STEALING, THREAD_POOL_MPMC_RING };
+    u_int32_t max_threads = thread_pool_default_threads();
+
+    for (int b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+      printf("Throughput (%s):\n", thread_pool_backend_name(backends[b]));
+
+      for (u_int32_t threads = 1; ; threads *= 2) {
+        if (threads > max_threads)
+          threads = max_threads;
+
+        thread_pool_t tpool;
+        thread_pool_init_backend(&tpool, threads, EXPRMT_HIGH_WATER, backends[b]);
+
+        struct timespec start;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < THROUGHPUT_JOBS; i++)
+          thread_pool_submit_job(&tpool, &empty_job, NULL);
+        thread_pool_wait_idle(&tpool);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        thread_pool_destroy(&tpool);
+
+        u_int64_t diff_ns = BILLION * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
+        printf("%u threads: %.0f jobs/s\n", threads, THROUGHPUT_JOBS * (double) BILLION / diff_ns);
+
+        if (threads == max_threads)
+          break;
+      }
+      printf("\n");
+    }
+  }
+
+  /* Strong blur the way users build it today, one 3x3 pass at a time. */
+  static void repeated_blur_picture(struct picture *pic) {
+    for (int i = 0; i < REPEATED_BLURS; i++)
+      blur_picture(pic);
+  }
+
+  /* Single Gaussian blur with the variance of REPEATED_BLURS 3x3 box passes
+     (8/12 each). */
+  static void equivalent_gaussian_blur_picture(struct picture *pic) {
+    gaussian_blur_picture(pic, sqrt(REPEATED_BLURS * 8.0 / 12.0));
+  }
+
+  static void *empty_job(void *args) {
+    return NULL;
+  }
+
+  static void *blur_job(void *vpic) {
+    parallel_blur_picture((struct picture *) vpic);
+    return NULL;
+  }
+
+  static void *invert_job(void *vpic) {
+    invert_picture((struct picture *) vpic);
+    return NULL;
+  }
+
   /* Creates and tests the picture at the provided pic_path with the provided blur function
      called label. The save boolean determines whether you want the picture to be saved.
      Returns whether loading and saving the picture is successful. */
@@ -66,9 +265,7 @@ static bool test_blur_func(blur_func func, char *pic_path, char *save_path, char
 
     for (int i = 0; i < NUM_TEST_RUNS; i++) {
       struct picture tmp_pic;
-      tmp_pic.img = copy_image(pic.img);
-      tmp_pic.width = pic.width;
-      tmp_pic.height = pic.height;
+      init_picture_copy(&tmp_pic, &pic);
       
       clock_gettime (CLOCK_MONOTONIC, &start);
       func(&tmp_pic);
@@ -85,7 +282,7 @@ static bool test_blur_func(blur_func func, char *pic_path, char *save_path, char
 
       if (i == NUM_TEST_RUNS - 1 && save) {
         clear_picture(&pic);
-        pic.img = copy_image(tmp_pic.img);
+        init_picture_copy(&pic, &tmp_pic);
       }
 
       avg_time_ns += diff_ns;
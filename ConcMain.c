@@ -6,11 +6,345 @@
 #include "PicProcess.h"
 #include "PicStore.h"
 
+  // longest command line read from the input
+  #define MAX_LINE_LENGTH 1024
+  // queued jobs at which the interpreter waits before submitting more
+  #define CONC_HIGH_WATER 4096
+  // environment variable holding the megabytes of pixels the store may keep in memory
+  #define BUDGET_ENV "PICSTORE_BUDGET_MB"
+
+  // pool every command, and the parallel transformations they call, run on
+  static thread_pool_t tpool;
+  // pictures loaded by the interpreter
+  static struct pic_store store;
+
+  // a command line, as handed to the job running it
+  struct command {
+    int cmd_no;
+    // picture the command works on, and its path, angle or plane (if any)
+    char *name;
+    char *arg;
+  };
+
+  // Commands still to run on one picture, in the order they were read. Only
+  // the interpreter's own thread looks at these.
+  struct picture_queue {
+    char *name;
+    // last command submitted on the picture
+    thread_pool_future_t *tail;
+    // last load or unload of the picture not yet waited for by a liststore
+    // (possibly tail itself, else a handle of its own)
+    thread_pool_future_t *membership;
+    struct picture_queue *next;
+  };
+
+  static struct picture_queue *queues = NULL;
+
+// -------------- picture command function wrappers -------------- \\
+
+  static void load_wrapper(struct command *cmd){
+    load_picture(&store, cmd->arg, cmd->name);
+  }
+
+  static void unload_wrapper(struct command *cmd){
+    unload_picture(&store, cmd->name);
+  }
+
+  static void save_wrapper(struct command *cmd){
+    save_picture(&store, cmd->name, cmd->arg);
+  }
+
+  // runs a transformation holding the picture's write lock
+  static void transform_wrapper(struct command *cmd, void (* transform)(struct picture *, const char *)){
+    struct pic_entry *entry = acquire_picture(&store, cmd->name, true);
+    if(entry == NULL){
+      printf("[!] no picture named %s is loaded\n", cmd->name);
+      return;
+    }
+    transform(&entry->pic, cmd->arg);
+    release_picture(entry);
+  }
+
+  static void invert(struct picture *pic, const char *unused){
+    invert_picture(pic);
+  }
+
+  static void grayscale(struct picture *pic, const char *unused){
+    grayscale_picture(pic);
+  }
+
+  static void rotate(struct picture *pic, const char *arg){
+    rotate_picture(pic, atoi(arg));
+  }
+
+  static void flip(struct picture *pic, const char *arg){
+    flip_picture(pic, arg[0]);
+  }
+
+  static void blur(struct picture *pic, const char *unused){
+    parallel_blur_picture(pic);
+  }
+
+  static void invert_wrapper(struct command *cmd){
+    transform_wrapper(cmd, invert);
+  }
+
+  static void grayscale_wrapper(struct command *cmd){
+    transform_wrapper(cmd, grayscale);
+  }
+
+  static void rotate_wrapper(struct command *cmd){
+    transform_wrapper(cmd, rotate);
+  }
+
+  static void flip_wrapper(struct command *cmd){
+    transform_wrapper(cmd, flip);
+  }
+
+  static void blur_wrapper(struct command *cmd){
+    transform_wrapper(cmd, blur);
+  }
+
+// ------------------------------------------------------------------------ \\
+
+  // list of all possible commands; those from liststore on run on the
+  // interpreter's own thread rather than as jobs
+  static char *cmd_strings[] = {
+    "load",
+    "unload",
+    "save",
+    "invert",
+    "grayscale",
+    "rotate",
+    "flip",
+    "blur",
+    "liststore",
+    "stats",
+    "exit"
+  };
+
+  enum { LOAD_CMD, UNLOAD_CMD, SAVE_CMD, ROTATE_CMD = 5, FLIP_CMD, LISTSTORE_CMD = 8, STATS_CMD, EXIT_CMD };
+
+  // function pointer look-up table for the commands run as jobs
+  static void (* const cmds[])(struct command *) = {
+    load_wrapper,
+    unload_wrapper,
+    save_wrapper,
+    invert_wrapper,
+    grayscale_wrapper,
+    rotate_wrapper,
+    flip_wrapper,
+    blur_wrapper
+  };
+
+  // words following each command: the picture's name, and an argument
+  // written before it (load path name, rotate angle name, flip plane name)
+  // or after it (save name path)
+  static const int cmd_args[] = { 2, 1, 2, 1, 1, 2, 2, 1, 0, 0, 0 };
+  static const bool cmd_name_first[] = { false, true, true, true, true, false, false, true, true, true, true };
+
+  // size of look-up table (for safe IO error reporting)
+  static int no_of_cmds = sizeof(cmd_strings) / sizeof(cmd_strings[0]);
+
+  // looks up a command by name (no_of_cmds if there is none)
+  static int find_cmd(const char *name){
+    int cmd_no = 0;
+    while(cmd_no < no_of_cmds && strcmp(name, cmd_strings[cmd_no])){
+      cmd_no++;
+    }
+    return cmd_no;
+  }
+
+  // checks the angle of a rotate or the plane of a flip before it is queued,
+  // since the transformations end the program on one they do not define
+  static bool check_arg(int cmd_no, const char *arg){
+    if(cmd_no == ROTATE_CMD){
+      int angle = atoi(arg);
+      if(angle != 90 && angle != 180 && angle != 270){
+        printf("[!] rotate is undefined for angle %s (must be 90, 180 or 270)\n", arg);
+        return false;
+      }
+    }
+    if(cmd_no == FLIP_CMD && arg[0] != 'H' && arg[0] != 'V'){
+      printf("[!] flip is undefined for plane %s (must be H or V)\n", arg);
+      return false;
+    }
+    return true;
+  }
+
+  static void *run_command(void *vcmd){
+    struct command *cmd = (struct command *) vcmd;
+    cmds[cmd->cmd_no](cmd);
+    free(cmd->name);
+    free(cmd->arg);
+    free(cmd);
+    return NULL;
+  }
+
+  static struct picture_queue *find_queue(const char *name){
+    struct picture_queue *queue = queues;
+    while(queue != NULL && strcmp(queue->name, name)){
+      queue = queue->next;
+    }
+    if(queue == NULL){
+      queue = malloc(sizeof(struct picture_queue));
+      queue->name = strdup(name);
+      queue->tail = NULL;
+      queue->membership = NULL;
+      queue->next = queues;
+      queues = queue;
+    }
+    return queue;
+  }
+
+  // submits the command to run once the last one on its picture has, so
+  // commands on one picture keep their order and those on others overlap
+  static void submit_command(int cmd_no, const char *name, const char *arg){
+    struct command *cmd = malloc(sizeof(struct command));
+    cmd->cmd_no = cmd_no;
+    cmd->name = strdup(name);
+    cmd->arg = arg != NULL ? strdup(arg) : NULL;
+
+    struct picture_queue *queue = find_queue(name);
+    thread_pool_future_t *last = queue->tail;
+    queue->tail = thread_pool_submit(&tpool, run_command, cmd, &last, last != NULL ? 1 : 0);
+    if(last != NULL && last != queue->membership){
+      thread_pool_future_release(last);
+    }
+
+    // the previous load or unload is no longer the tail either way, so its
+    // handle is only kept while it is the membership
+    if(cmd_no == LOAD_CMD || cmd_no == UNLOAD_CMD){
+      if(queue->membership != NULL){
+        thread_pool_future_release(queue->membership);
+      }
+      queue->membership = queue->tail;
+    }
+  }
+
+  // lists the pictures once every load and unload read so far has run, but
+  // without waiting for the other commands in flight
+  static void list_store(void){
+    for(struct picture_queue *queue = queues; queue != NULL; queue = queue->next){
+      if(queue->membership != NULL){
+        thread_pool_future_wait(queue->membership);
+        if(queue->membership != queue->tail){
+          thread_pool_future_release(queue->membership);
+        }
+        queue->membership = NULL;
+      }
+    }
+    print_picstore(&store);
+  }
+
+  static void print_stats(void){
+    thread_pool_stats_t *stats = thread_pool_stats(&tpool);
+    thread_pool_stats_json(stdout, stats);
+    free(stats);
+    print_picstore_stats(&store);
+  }
+
+  // waits for every command read so far to have run
+  static void drain_queues(void){
+    while(queues != NULL){
+      struct picture_queue *queue = queues;
+      queues = queue->next;
+      thread_pool_future_wait(queue->tail);
+      if(queue->membership != NULL && queue->membership != queue->tail){
+        thread_pool_future_release(queue->membership);
+      }
+      thread_pool_future_release(queue->tail);
+      free(queue->name);
+      free(queue);
+    }
+  }
+
+  // name a picture preloaded from the command line is stored under: its
+  // file name without directories or extension
+  static char *picture_name(const char *path){
+    const char *base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+    char *name = strdup(base);
+    char *extension = strrchr(name, '.');
+    if(extension != NULL && extension != name){
+      *extension = '\0';
+    }
+    return name;
+  }
+
+  // parses and dispatches one command line; returns false on exit
+  static bool interpret(char *line){
+    char *words[4];
+    int num_words = 0;
+    for(char *word = strtok(line, " \t\r\n"); word != NULL && num_words < 4; word = strtok(NULL, " \t\r\n")){
+      words[num_words++] = word;
+    }
+    // blank lines are skipped
+    if(num_words == 0){
+      return true;
+    }
+
+    int cmd_no = find_cmd(words[0]);
+    if(cmd_no == no_of_cmds){
+      printf("[!] invalid command: %s is not defined\n", words[0]);
+      return true;
+    }
+    if(num_words - 1 != cmd_args[cmd_no]){
+      printf("[!] %s expects %i argument(s)\n", words[0], cmd_args[cmd_no]);
+      return true;
+    }
+
+    switch(cmd_no){
+      case LISTSTORE_CMD:
+        list_store();
+        return true;
+      case STATS_CMD:
+        print_stats();
+        return true;
+      case EXIT_CMD:
+        return false;
+    }
+
+    if(cmd_args[cmd_no] == 1){
+      submit_command(cmd_no, words[1], NULL);
+    }
+    else if(cmd_name_first[cmd_no]){
+      submit_command(cmd_no, words[1], words[2]);
+    }
+    else if(check_arg(cmd_no, words[1])){
+      submit_command(cmd_no, words[2], words[1]);
+    }
+    return true;
+  }
+
+
 // ---------- MAIN PROGRAM ---------- \\
 
   int main(int argc, char **argv){
 
     printf("Running the Interactive C Picture Processing Library... \n");
-    //TODO: implement the interactive command-line interpreter for the Optional Extension
 
+    thread_pool_init(&tpool, thread_pool_default_threads(), CONC_HIGH_WATER);
+    set_picture_thread_pool(&tpool);
+    // the store is unlimited unless given a budget
+    const char *budget = getenv(BUDGET_ENV);
+    init_picstore(&store, budget != NULL ? atol(budget) * 1024 * 1024 : 0);
+
+    // pictures named on the command line are loaded as if by load commands
+    for(int i = 1; i < argc; i++){
+      char *name = picture_name(argv[i]);
+      submit_command(LOAD_CMD, name, argv[i]);
+      free(name);
+    }
+
+    // run commands until exit or the end of the input, then let them finish
+    char line[MAX_LINE_LENGTH];
+    while(fgets(line, sizeof(line), stdin) != NULL && interpret(line)){
+    }
+    drain_queues();
+
+    set_picture_thread_pool(NULL);
+    thread_pool_destroy(&tpool);
+    clear_picstore(&store);
+    return 0;
   }
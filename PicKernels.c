@@ -0,0 +1,448 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "PicKernels.h"
+#include "Utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+  #define KERNELS_ENV "PIC_KERNELS"
+
+// -------------- scalar kernels (also used for the SIMD tails) -------------- \\
+
+  static void invert_scalar(float *data, long n){
+    for(long k = 0; k < n; k++){
+      int value = data[k] * MAX_PIXEL_INTENSITY;
+      data[k] = (int) (MAX_PIXEL_INTENSITY - value) / MAX_PIXEL_INTENSITY;
+    }
+  }
+
+  static void grayscale_scalar(float *red, float *green, float *blue, long n){
+    for(long k = 0; k < n; k++){
+      int sum = (int) (red[k] * MAX_PIXEL_INTENSITY) + (int) (green[k] * MAX_PIXEL_INTENSITY)
+                + (int) (blue[k] * MAX_PIXEL_INTENSITY);
+      float gray = (sum / 3) / MAX_PIXEL_INTENSITY;
+      red[k] = gray;
+      green[k] = gray;
+      blue[k] = gray;
+    }
+  }
+
+  static void quantise_scalar(const float *src, int *dst, long n){
+    for(long k = 0; k < n; k++){
+      dst[k] = src[k] * MAX_PIXEL_INTENSITY;
+    }
+  }
+
+  static void sum3_scalar(const int *q, int *sums, long n){
+    for(long i = 1; i < n - 1; i++){
+      sums[i] = q[i - 1] + q[i] + q[i + 1];
+    }
+  }
+
+  static void add_scalar(int *acc, const int *x, long n){
+    for(long k = 0; k < n; k++){
+      acc[k] += x[k];
+    }
+  }
+
+  static void sub_scalar(int *acc, const int *x, long n){
+    for(long k = 0; k < n; k++){
+      acc[k] -= x[k];
+    }
+  }
+
+  static void average_scalar(const int *sums, int divisor, float *out, long n){
+    for(long k = 0; k < n; k++){
+      out[k] = (sums[k] / divisor) / MAX_PIXEL_INTENSITY;
+    }
+  }
+
+  static void invert_intensities_scalar(int *q, long n){
+    for(long k = 0; k < n; k++){
+      q[k] = (int) MAX_PIXEL_INTENSITY - q[k];
+    }
+  }
+
+  static void grayscale_intensities_scalar(int *red, int *green, int *blue, long n){
+    for(long k = 0; k < n; k++){
+      int gray = (red[k] + green[k] + blue[k]) / 3;
+      red[k] = gray;
+      green[k] = gray;
+      blue[k] = gray;
+    }
+  }
+
+  static void divide_scalar(int *q, int divisor, long n){
+    for(long k = 0; k < n; k++){
+      q[k] /= divisor;
+    }
+  }
+
+  static void dequantise_scalar(const int *q, float *dst, long n){
+    for(long k = 0; k < n; k++){
+      dst[k] = q[k] / MAX_PIXEL_INTENSITY;
+    }
+  }
+
+  static const struct pic_kernels scalar_kernels = {
+    "scalar", invert_scalar, grayscale_scalar, quantise_scalar, sum3_scalar,
+    add_scalar, sub_scalar, average_scalar, invert_intensities_scalar,
+    grayscale_intensities_scalar, divide_scalar, dequantise_scalar
+  };
+
+#ifdef X86_KERNELS
+
+// -------------- SSE2 kernels (4 pixels at a time) -------------- \\
+
+  // The intensity arithmetic is done in double precision, exactly as the
+  // scalar code does, so that truncation gives identical integers. Quotients
+  // of non-negative integers by 3 or 9 are never rounded across an integer,
+  // so truncating them in double matches integer division. For the
+  // intensities 0 to MAX_PIXEL_INTENSITY, multiplying by the reciprocal of
+  // MAX_PIXEL_INTENSITY in double rounds to the same floats as dividing.
+
+  static inline __m128i quantise4_sse2(const float *src){
+    __m128 v = _mm_loadu_ps(src);
+    __m128d scale = _mm_set1_pd(MAX_PIXEL_INTENSITY);
+    __m128i lo = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtps_pd(v), scale));
+    __m128i hi = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), scale));
+    return _mm_unpacklo_epi64(lo, hi);
+  }
+
+  static inline __m128 intensity4_sse2(__m128i q){
+    __m128d scale = _mm_set1_pd(MAX_PIXEL_INTENSITY);
+    __m128 lo = _mm_cvtpd_ps(_mm_div_pd(_mm_cvtepi32_pd(q), scale));
+    __m128 hi = _mm_cvtpd_ps(_mm_div_pd(_mm_cvtepi32_pd(_mm_srli_si128(q, 8)), scale));
+    return _mm_movelh_ps(lo, hi);
+  }
+
+  static inline __m128i divide4_sse2(__m128i q, double divisor){
+    __m128d d = _mm_set1_pd(divisor);
+    __m128i lo = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(q), d));
+    __m128i hi = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(_mm_srli_si128(q, 8)), d));
+    return _mm_unpacklo_epi64(lo, hi);
+  }
+
+  static void invert_sse2(float *data, long n){
+    __m128i max = _mm_set1_epi32((int) MAX_PIXEL_INTENSITY);
+    long k = 0;
+    for(; k + 4 <= n; k += 4){
+      _mm_storeu_ps(data + k, intensity4_sse2(_mm_sub_epi32(max, quantise4_sse2(data + k))));
+    }
+    invert_scalar(data + k, n - k);
+  }
+
+  static void grayscale_sse2(float *red, float *green, float *blue, long n){
+    long k = 0;
+    for(; k + 4 <= n; k += 4){
+      __m128i sum = _mm_add_epi32(_mm_add_epi32(quantise4_sse2(red + k), quantise4_sse2(green + k)),
+                                  quantise4_sse2(blue + k));
+      __m128 gray = intensity4_sse2(divide4_sse2(sum, 3.0));
+      _mm_storeu_ps(red + k, gray);
+      _mm_storeu_ps(green + k, gray);
+      _mm_storeu_ps(blue + k, gray);
+    }
+    grayscale_scalar(red + k, green + k, blue + k, n - k);
+  }
+
+  static void quantise_sse2(const float *src, int *dst, long n){
+    long k = 0;
+    for(; k + 4 <= n; k += 4){
+      _mm_storeu_si128((__m128i *) (dst + k), quantise4_sse2(src + k));
+    }
+    quantise_scalar(src + k, dst + k, n - k);
+  }
+
+  static void sum3_sse2(const int *q, int *sums, long n){
+    long i = 1;
+    for(; i + 4 <= n - 1; i += 4){
+      __m128i left = _mm_loadu_si128((const __m128i *) (q + i - 1));
+      __m128i mid = _mm_loadu_si128((const __m128i *) (q + i));
+      __m128i right = _mm_loadu_si128((const __m128i *) (q + i + 1));
+      _mm_storeu_si128((__m128i *) (sums + i), _mm_add_epi32(_mm_add_epi32(left, mid), right));
+    }
+    // the tail starts one pixel early so that its first sum has a left neighbour
+    if(i < n - 1){
+      sum3_scalar(q + i - 1, sums + i - 1, n - i + 1);
+    }
+  }
+
+  static void add_sse2(int *acc, const int *x, long n){
+    long k = 0;
+    for(; k + 4 <= n; k += 4){
+      __m128i a = _mm_loadu_si128((const __m128i *) (acc + k));
+      _mm_storeu_si128((__m128i *) (acc + k), _mm_add_epi32(a, _mm_loadu_si128((const __m128i *) (x + k))));
+    }
+    add_scalar(acc + k, x + k, n - k);
+  }
+
+  static void sub_sse2(int *acc, const int *x, long n){
+    long k = 0;
+    for(; k + 4 <= n; k += 4){
+      __m128i a = _mm_loadu_si128((const __m128i *) (acc + k));
+      _mm_storeu_si128((__m128i *) (acc + k), _mm_sub_epi32(a, _mm_loadu_si128((const __m128i *) (x + k))));
+    }
+    sub_scalar(acc + k, x + k, n - k);
+  }
+
+  static void average_sse2(const int *sums, int divisor, float *out, long n){
+    long k = 0;
+    for(; k + 4 <= n; k += 4){
+      __m128i s = _mm_loadu_si128((const __m128i *) (sums + k));
+      _mm_storeu_ps(out + k, intensity4_sse2(divide4_sse2(s, divisor)));
+    }
+    average_scalar(sums + k, divisor, out + k, n - k);
+  }
+
+  static void invert_intensities_sse2(int *q, long n){
+    __m128i max = _mm_set1_epi32((int) MAX_PIXEL_INTENSITY);
+    long k = 0;
+    for(; k + 4 <= n; k += 4){
+      __m128i v = _mm_loadu_si128((const __m128i *) (q + k));
+      _mm_storeu_si128((__m128i *) (q + k), _mm_sub_epi32(max, v));
+    }
+    invert_intensities_scalar(q + k, n - k);
+  }
+
+  static void grayscale_intensities_sse2(int *red, int *green, int *blue, long n){
+    long k = 0;
+    for(; k + 4 <= n; k += 4){
+      __m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i *) (red + k)),
+                                                _mm_loadu_si128((const __m128i *) (green + k))),
+                                  _mm_loadu_si128((const __m128i *) (blue + k)));
+      __m128i gray = divide4_sse2(sum, 3.0);
+      _mm_storeu_si128((__m128i *) (red + k), gray);
+      _mm_storeu_si128((__m128i *) (green + k), gray);
+      _mm_storeu_si128((__m128i *) (blue + k), gray);
+    }
+    grayscale_intensities_scalar(red + k, green + k, blue + k, n - k);
+  }
+
+  static void divide_sse2(int *q, int divisor, long n){
+    long k = 0;
+    for(; k + 4 <= n; k += 4){
+      __m128i v = _mm_loadu_si128((const __m128i *) (q + k));
+      _mm_storeu_si128((__m128i *) (q + k), divide4_sse2(v, divisor));
+    }
+    divide_scalar(q + k, divisor, n - k);
+  }
+
+  static void dequantise_sse2(const int *q, float *dst, long n){
+    __m128d scale = _mm_set1_pd(1 / MAX_PIXEL_INTENSITY);
+    long k = 0;
+    for(; k + 4 <= n; k += 4){
+      __m128i v = _mm_loadu_si128((const __m128i *) (q + k));
+      __m128 lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtepi32_pd(v), scale));
+      __m128 hi = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(v, 8)), scale));
+      _mm_storeu_ps(dst + k, _mm_movelh_ps(lo, hi));
+    }
+    dequantise_scalar(q + k, dst + k, n - k);
+  }
+
+  static const struct pic_kernels sse2_kernels = {
+    "sse2", invert_sse2, grayscale_sse2, quantise_sse2, sum3_sse2,
+    add_sse2, sub_sse2, average_sse2, invert_intensities_sse2,
+    grayscale_intensities_sse2, divide_sse2, dequantise_sse2
+  };
+
+// -------------- AVX2 kernels (8 pixels at a time) -------------- \\
+
+  #define AVX2 __attribute__((target("avx2")))
+
+  static inline AVX2 __m256i quantise8_avx2(const float *src){
+    __m256 v = _mm256_loadu_ps(src);
+    __m256d scale = _mm256_set1_pd(MAX_PIXEL_INTENSITY);
+    __m128i lo = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), scale));
+    __m128i hi = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)), scale));
+    return _mm256_set_m128i(hi, lo);
+  }
+
+  static inline AVX2 __m256 intensity8_avx2(__m256i q){
+    __m256d scale = _mm256_set1_pd(MAX_PIXEL_INTENSITY);
+    __m128 lo = _mm256_cvtpd_ps(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(q)), scale));
+    __m128 hi = _mm256_cvtpd_ps(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(q, 1)), scale));
+    return _mm256_set_m128(hi, lo);
+  }
+
+  static inline AVX2 __m256i divide8_avx2(__m256i q, double divisor){
+    __m256d d = _mm256_set1_pd(divisor);
+    __m128i lo = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(q)), d));
+    __m128i hi = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(q, 1)), d));
+    return _mm256_set_m128i(hi, lo);
+  }
+
+  static AVX2 void invert_avx2(float *data, long n){
+    __m256i max = _mm256_set1_epi32((int) MAX_PIXEL_INTENSITY);
+    long k = 0;
+    for(; k + 8 <= n; k += 8){
+      _mm256_storeu_ps(data + k, intensity8_avx2(_mm256_sub_epi32(max, quantise8_avx2(data + k))));
+    }
+    invert_scalar(data + k, n - k);
+  }
+
+  static AVX2 void grayscale_avx2(float *red, float *green, float *blue, long n){
+    long k = 0;
+    for(; k + 8 <= n; k += 8){
+      __m256i sum = _mm256_add_epi32(_mm256_add_epi32(quantise8_avx2(red + k), quantise8_avx2(green + k)),
+                                     quantise8_avx2(blue + k));
+      __m256 gray = intensity8_avx2(divide8_avx2(sum, 3.0));
+      _mm256_storeu_ps(red + k, gray);
+      _mm256_storeu_ps(green + k, gray);
+      _mm256_storeu_ps(blue + k, gray);
+    }
+    grayscale_scalar(red + k, green + k, blue + k, n - k);
+  }
+
+  static AVX2 void quantise_avx2(const float *src, int *dst, long n){
+    long k = 0;
+    for(; k + 8 <= n; k += 8){
+      _mm256_storeu_si256((__m256i *) (dst + k), quantise8_avx2(src + k));
+    }
+    quantise_scalar(src + k, dst + k, n - k);
+  }
+
+  static AVX2 void sum3_avx2(const int *q, int *sums, long n){
+    long i = 1;
+    for(; i + 8 <= n - 1; i += 8){
+      __m256i left = _mm256_loadu_si256((const __m256i *) (q + i - 1));
+      __m256i mid = _mm256_loadu_si256((const __m256i *) (q + i));
+      __m256i right = _mm256_loadu_si256((const __m256i *) (q + i + 1));
+      _mm256_storeu_si256((__m256i *) (sums + i), _mm256_add_epi32(_mm256_add_epi32(left, mid), right));
+    }
+    if(i < n - 1){
+      sum3_scalar(q + i - 1, sums + i - 1, n - i + 1);
+    }
+  }
+
+  static AVX2 void add_avx2(int *acc, const int *x, long n){
+    long k = 0;
+    for(; k + 8 <= n; k += 8){
+      __m256i a = _mm256_loadu_si256((const __m256i *) (acc + k));
+      _mm256_storeu_si256((__m256i *) (acc + k), _mm256_add_epi32(a, _mm256_loadu_si256((const __m256i *) (x + k))));
+    }
+    add_scalar(acc + k, x + k, n - k);
+  }
+
+  static AVX2 void sub_avx2(int *acc, const int *x, long n){
+    long k = 0;
+    for(; k + 8 <= n; k += 8){
+      __m256i a = _mm256_loadu_si256((const __m256i *) (acc + k));
+      _mm256_storeu_si256((__m256i *) (acc + k), _mm256_sub_epi32(a, _mm256_loadu_si256((const __m256i *) (x + k))));
+    }
+    sub_scalar(acc + k, x + k, n - k);
+  }
+
+  static AVX2 void average_avx2(const int *sums, int divisor, float *out, long n){
+    long k = 0;
+    for(; k + 8 <= n; k += 8){
+      __m256i s = _mm256_loadu_si256((const __m256i *) (sums + k));
+      _mm256_storeu_ps(out + k, intensity8_avx2(divide8_avx2(s, divisor)));
+    }
+    average_scalar(sums + k, divisor, out + k, n - k);
+  }
+
+  static AVX2 void invert_intensities_avx2(int *q, long n){
+    __m256i max = _mm256_set1_epi32((int) MAX_PIXEL_INTENSITY);
+    long k = 0;
+    for(; k + 8 <= n; k += 8){
+      __m256i v = _mm256_loadu_si256((const __m256i *) (q + k));
+      _mm256_storeu_si256((__m256i *) (q + k), _mm256_sub_epi32(max, v));
+    }
+    invert_intensities_scalar(q + k, n - k);
+  }
+
+  static AVX2 void grayscale_intensities_avx2(int *red, int *green, int *blue, long n){
+    long k = 0;
+    for(; k + 8 <= n; k += 8){
+      __m256i sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i *) (red + k)),
+                                                      _mm256_loadu_si256((const __m256i *) (green + k))),
+                                     _mm256_loadu_si256((const __m256i *) (blue + k)));
+      __m256i gray = divide8_avx2(sum, 3.0);
+      _mm256_storeu_si256((__m256i *) (red + k), gray);
+      _mm256_storeu_si256((__m256i *) (green + k), gray);
+      _mm256_storeu_si256((__m256i *) (blue + k), gray);
+    }
+    grayscale_intensities_scalar(red + k, green + k, blue + k, n - k);
+  }
+
+  static AVX2 void divide_avx2(int *q, int divisor, long n){
+    long k = 0;
+    for(; k + 8 <= n; k += 8){
+      __m256i v = _mm256_loadu_si256((const __m256i *) (q + k));
+      _mm256_storeu_si256((__m256i *) (q + k), divide8_avx2(v, divisor));
+    }
+    divide_scalar(q + k, divisor, n - k);
+  }
+
+  static AVX2 void dequantise_avx2(const int *q, float *dst, long n){
+    __m256d scale = _mm256_set1_pd(1 / MAX_PIXEL_INTENSITY);
+    long k = 0;
+    for(; k + 8 <= n; k += 8){
+      __m256i v = _mm256_loadu_si256((const __m256i *) (q + k));
+      __m128 lo = _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(v)), scale));
+      __m128 hi = _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)), scale));
+      _mm256_storeu_ps(dst + k, _mm256_set_m128(hi, lo));
+    }
+    dequantise_scalar(q + k, dst + k, n - k);
+  }
+
+  static const struct pic_kernels avx2_kernels = {
+    "avx2", invert_avx2, grayscale_avx2, quantise_avx2, sum3_avx2,
+    add_avx2, sub_avx2, average_avx2, invert_intensities_avx2,
+    grayscale_intensities_avx2, divide_avx2, dequantise_avx2
+  };
+
+#endif
+
+// ------------------------------------------------------------------------ \\
+
+  static const struct pic_kernels *current_kernels = NULL;
+  static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+  /* Returns the kernels with the given name if this CPU can run them, else NULL. */
+  static const struct pic_kernels *find_kernels(const char *name){
+    if(strcmp(name, scalar_kernels.name) == 0){
+      return &scalar_kernels;
+    }
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if(strcmp(name, sse2_kernels.name) == 0 && __builtin_cpu_supports("sse2")){
+      return &sse2_kernels;
+    }
+    if(strcmp(name, avx2_kernels.name) == 0 && __builtin_cpu_supports("avx2")){
+      return &avx2_kernels;
+    }
+#endif
+    return NULL;
+  }
+
+  static void init_kernels(void){
+    const char *env = getenv(KERNELS_ENV);
+    const char *preferred[] = { "avx2", "sse2", "scalar" };
+
+    if(env != NULL && (current_kernels = find_kernels(env)) != NULL){
+      return;
+    }
+    for(int k = 0; current_kernels == NULL; k++){
+      current_kernels = find_kernels(preferred[k]);
+    }
+  }
+
+  const struct pic_kernels *get_pic_kernels(void){
+    pthread_once(&kernels_once, &init_kernels);
+    return current_kernels;
+  }
+
+  bool select_pic_kernels(const char *name){
+    pthread_once(&kernels_once, &init_kernels);
+    const struct pic_kernels *kernels = find_kernels(name);
+    if(kernels == NULL){
+      return false;
+    }
+    current_kernels = kernels;
+    return true;
+  }
@@ -0,0 +1,42 @@
+#ifndef PICKERNELS_H
+#define PICKERNELS_H
+
+#include <stdbool.h>
+
+  // Kernels working directly on spans of n consecutive floats of the planar
+  // sod_img data. They give bit for bit the results of going through
+  // get_pixel/set_pixel, i.e. intensities are truncated to integers as
+  // (int) (value * MAX_PIXEL_INTENSITY) and stored back as int / MAX_PIXEL_INTENSITY.
+  struct pic_kernels {
+    const char *name;
+    // value = MAX - value, in place
+    void (* invert)(float *data, long n);
+    // red = green = blue = (red + green + blue) / 3, in place
+    void (* grayscale)(float *red, float *green, float *blue, long n);
+    // dst = the integer intensity of src
+    void (* quantise)(const float *src, int *dst, long n);
+    // sums[i] = q[i - 1] + q[i] + q[i + 1] for i in [1, n - 1)
+    void (* sum3)(const int *q, int *sums, long n);
+    // acc += x and acc -= x
+    void (* add)(int *acc, const int *x, long n);
+    void (* sub)(int *acc, const int *x, long n);
+    // out = the intensity (sums / divisor)
+    void (* average)(const int *sums, int divisor, float *out, long n);
+    // invert and grayscale on integer intensities, in place
+    void (* invert_intensities)(int *q, long n);
+    void (* grayscale_intensities)(int *red, int *green, int *blue, long n);
+    // q = q / divisor, in place
+    void (* divide)(int *q, int divisor, long n);
+    // dst = the value set_pixel stores for the intensity q, for q in [0, MAX]
+    void (* dequantise)(const int *q, float *dst, long n);
+  };
+
+  // Kernels for the best instruction set this CPU supports (or the ones
+  // named by the PIC_KERNELS environment variable), chosen on first use.
+  const struct pic_kernels *get_pic_kernels(void);
+
+  // Switches to the kernels with the given name ("scalar", "sse2" or "avx2").
+  // Returns false, leaving the kernels unchanged, if this CPU cannot run them.
+  bool select_pic_kernels(const char *name);
+
+#endif
@@ -1,124 +1,406 @@
+#include <math.h>
 #include <pthread.h>
+#include <string.h>
+#include "PicKernels.h"
 #include "PicProcess.h"
 #include "ThreadPool.h"
 
   #define NO_RGB_COMPONENTS 3
   #define BLUR_REGION_SIZE 9
-  #define THREAD_POOL_DEFAULT_THREADS 64
+  #define THREAD_POOL_HIGH_WATER 4096
+  #define MIN_PIXELS_PER_JOB 4096
+  #define MIN_BLUR_ROWS_PER_JOB 16
+  #define MIN_COLUMNS_PER_JOB 64
+  #define GAUSSIAN_BOX_PASSES 3
+  #define ROTATE_TILE_SIZE 64
+  // rows of scratch ints a band of box_blur_rows works in, and a band of
+  // blur_pass_rows per colour plane
+  #define BOX_BLUR_ROWS 5
+  #define PIPELINE_BLUR_ROWS 7
 
+  // scratch ints of a pass over bands of rows, split between the bands of
+  // grain rows from begin, band_size ints each
+  struct band_scratch {
+    int *ints;
+    long size;
+    long begin;
+    long grain;
+    long band_size;
+  };
+
+  // state shared by the rows/tiles of a transformation running on the thread pool
+  struct transform_args {
+    struct picture *pic;
+    struct picture *tmp;
+    int angle;
+    struct band_scratch *scratch;
+  };
+
+  // state shared by the rows of a summed-area table blur of one colour plane
+  struct plane_blur_args {
+    float *plane;
+    // integer intensities blurred from src into dst
+    int *src;
+    int *dst;
+    // (width + 1) x (height + 1) summed-area table of src
+    long *table;
+    int width;
+    int height;
+    int radius;
+    // whether windows are clipped to the picture, rather than pixels whose
+    // window would leave it being left unchanged
+    bool clip;
+  };
+
+  // state shared by the row bands of one fused pass of a picture pipeline
+  struct pipeline_pass_args {
+    struct picture *pic;
+    // picture the pass reads from (pic itself when there is no blur)
+    struct picture *src;
+    // point operations applied before the blur, and after it
+    const struct pipeline_op *pre_ops;
+    int num_pre_ops;
+    const struct pipeline_op *post_ops;
+    int num_post_ops;
+    bool blur;
+    enum blur_border border;
+    struct band_scratch *scratch;
+  };
+
+  static thread_pool_t *get_thread_pool(void);
+  static long row_grain(struct picture *pic);
   static void blur_individual_pixel(struct picture *pic, struct picture *tmp, int i, int j);
+  static void box_blur_rows(void *vargs, long start_j, long end_j);
 
-  void invert_picture(struct picture *pic){
-    // iterate over each pixel in the picture
-    for(int i = 0 ; i < pic->width; i++){
-      for(int j = 0 ; j < pic->height; j++){
-        struct pixel rgb = get_pixel(pic, i, j);
-        
-        // invert RGB values of pixel
-        rgb.red = MAX_PIXEL_INTENSITY - rgb.red;
-        rgb.green = MAX_PIXEL_INTENSITY - rgb.green;
-        rgb.blue = MAX_PIXEL_INTENSITY - rgb.blue;
-        
-        // set pixel to inverted RBG values
-        set_pixel(pic, i, j, &rgb);
+  // process-wide thread pool shared by every parallel transformation
+  static thread_pool_t shared_tpool;
+  static pthread_once_t shared_tpool_once = PTHREAD_ONCE_INIT;
+  static thread_pool_t *installed_tpool = NULL;
+
+  static void init_shared_thread_pool(void){
+    thread_pool_init(&shared_tpool, thread_pool_default_threads(), THREAD_POOL_HIGH_WATER);
+  }
+
+  /* Returns the shared thread pool, starting its workers on first use.
+     The pool lives for the rest of the process so that successive parallel
+     transformations reuse the same threads. */
+  static thread_pool_t *get_thread_pool(void){
+    if(installed_tpool != NULL){
+      return installed_tpool;
+    }
+    pthread_once(&shared_tpool_once, &init_shared_thread_pool);
+    return &shared_tpool;
+  }
+
+  /* Makes the parallel transformations run on tpool instead of the shared pool
+     (NULL restores the shared pool). Must not be called while a parallel
+     transformation is running. */
+  void set_picture_thread_pool(thread_pool_t *tpool){
+    installed_tpool = tpool;
+  }
+
+  /* Returns the number of rows per job for row-parallel transformations,
+     which scales with the core count but keeps each job big enough to be
+     worth scheduling. */
+  static long row_grain(struct picture *pic){
+    long min_rows = (MIN_PIXELS_PER_JOB + pic->width - 1) / pic->width;
+    return thread_pool_auto_grain(get_thread_pool(), pic->height, min_rows);
+  }
+
+  /* Expands a compact picture to the float planes for a transformation that
+     works on them, returning whether restore_compact_picture should compact
+     it again afterwards. */
+  static bool expand_compact_picture(struct picture *pic){
+    bool compact = is_compact_picture(pic);
+    expand_picture(pic);
+    return compact;
+  }
+
+  static void restore_compact_picture(struct picture *pic, bool compact){
+    if(compact){
+      compact_picture(pic);
+    }
+  }
+
+  /* Starts a transformation that reads the picture's current image through
+     src while writing its new width x height image into pic, which is taken
+     from the back buffer when the picture has one. Nothing is copied. */
+  static void begin_transform(struct picture *pic, struct picture *src, int width, int height){
+    *src = *pic;
+    pic->img = take_back_buffer(pic, width, height);
+    pic->width = width;
+    pic->height = height;
+  }
+
+  /* Finishes a transformation, keeping the image it read from as the back
+     buffer of a double buffered picture and freeing it otherwise. */
+  static void end_transform(struct picture *pic, struct picture *src){
+    return_back_buffer(pic, src->img);
+  }
+
+  /* Splits the scratch between the bands of grain rows covering [begin, end),
+     taking the picture's (or growing it) if it is too small for them all. */
+  static void split_band_scratch(struct picture *pic, struct band_scratch *scratch, long begin, long end,
+                                 long grain, long band_size){
+    long bands = end > begin ? (end - begin + grain - 1) / grain : 0;
+    if(bands * band_size > scratch->size){
+      free(scratch->ints);
+      scratch->ints = take_scratch(pic, bands * band_size, &scratch->size);
+    }
+    scratch->begin = begin;
+    scratch->grain = grain;
+    scratch->band_size = band_size;
+  }
+
+  /* Scratch of the band of rows starting at start_j. */
+  static int *band_scratch(struct band_scratch *scratch, long start_j){
+    return scratch->ints + (start_j - scratch->begin) / scratch->grain * scratch->band_size;
+  }
+
+  /* Hands the scratch back to the picture, to be kept for the next pass if
+     it is double buffered. */
+  static void return_band_scratch(struct picture *pic, struct band_scratch *scratch){
+    if(scratch->ints != NULL){
+      return_scratch(pic, scratch->ints, scratch->size);
+    }
+  }
+
+  /* Starts a blur, which only writes the non-boundary pixels: the boundary
+     pixels are carried over to the new image. */
+  static void begin_blur(struct picture *pic, struct picture *src){
+    begin_transform(pic, src, pic->width, pic->height);
+    int width = pic->width;
+    int height = pic->height;
+
+    for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+      memcpy(picture_row(pic, c, 0), picture_row(src, c, 0), width * sizeof(float));
+      memcpy(picture_row(pic, c, height - 1), picture_row(src, c, height - 1), width * sizeof(float));
+      for(int j = 1; j < height - 1; j++){
+        picture_row(pic, c, j)[0] = picture_row(src, c, j)[0];
+        picture_row(pic, c, j)[width - 1] = picture_row(src, c, j)[width - 1];
       }
-    }   
+    }
+  }
+
+  static void invert_rows(void *vargs, long start_j, long end_j){
+    struct picture *pic = ((struct transform_args *) vargs)->pic;
+
+    // the rows are contiguous in each colour plane, so invert them in one span
+    for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+      get_pic_kernels()->invert(picture_row(pic, c, start_j), (end_j - start_j) * pic->width);
+    }
+  }
+
+  static void invert_compact_rows(void *vargs, long start_j, long end_j){
+    struct picture *pic = ((struct transform_args *) vargs)->pic;
+    uint8_t *pixels = compact_picture_row(pic, start_j);
+    long n = (end_j - start_j) * pic->width * COMPACT_PIXEL_SIZE;
+
+    // the rows are contiguous, so invert every channel of them in one span
+    for(long k = 0; k < n; k++){
+      pixels[k] = (int) MAX_PIXEL_INTENSITY - pixels[k];
+    }
+  }
+
+  void invert_picture(struct picture *pic){
+    struct transform_args args = { pic, NULL };
+    thread_pool_range_fn *rows = is_compact_picture(pic) ? &invert_compact_rows : &invert_rows;
+    thread_pool_parallel_for(get_thread_pool(), 0, pic->height, row_grain(pic), rows, &args);
+  }
+
+  static void grayscale_rows(void *vargs, long start_j, long end_j){
+    struct picture *pic = ((struct transform_args *) vargs)->pic;
+
+    // average the same span of rows across the three colour planes
+    get_pic_kernels()->grayscale(picture_row(pic, 0, start_j), picture_row(pic, 1, start_j),
+                                 picture_row(pic, 2, start_j), (end_j - start_j) * pic->width);
+  }
+
+  static void grayscale_compact_rows(void *vargs, long start_j, long end_j){
+    struct picture *pic = ((struct transform_args *) vargs)->pic;
+    uint8_t *pixel = compact_picture_row(pic, start_j);
+    uint8_t *end = compact_picture_row(pic, end_j);
+
+    for(; pixel < end; pixel += COMPACT_PIXEL_SIZE){
+      int gray = (pixel[0] + pixel[1] + pixel[2]) / 3;
+      pixel[0] = gray;
+      pixel[1] = gray;
+      pixel[2] = gray;
+    }
   }
 
   void grayscale_picture(struct picture *pic){
-    // iterate over each pixel in the picture
-    for(int i = 0 ; i < pic->width; i++){
-      for(int j = 0 ; j < pic->height; j++){
-        struct pixel rgb = get_pixel(pic, i, j);
-        
-        // compute gray average of pixel's RGB values
-        int avg = (rgb.red + rgb.green + rgb.blue) / NO_RGB_COMPONENTS;
-        rgb.red = avg;
-        rgb.green = avg;
-        rgb.blue = avg;
-        
-        // set pixel to gray-scale RBG value
-        set_pixel(pic, i, j, &rgb);
+    struct transform_args args = { pic, NULL };
+    thread_pool_range_fn *rows = is_compact_picture(pic) ? &grayscale_compact_rows : &grayscale_rows;
+    thread_pool_parallel_for(get_thread_pool(), 0, pic->height, row_grain(pic), rows, &args);
+  }
+
+  // intensity a pixel value has once it has been through get_pixel/set_pixel
+  static inline float quantise_intensity(float value){
+    int intensity = value * MAX_PIXEL_INTENSITY;
+    return intensity / MAX_PIXEL_INTENSITY;
+  }
+
+  /* Rotates one tile [start_i, end_i) x [start_j, end_j) of the output picture.
+     Each output pixel (i, j) reads source index base + i * step_i + j * step_j,
+     so a tile reads a tile of the source too and both stay in cache, rather
+     than every output row walking down a whole source column. */
+  static void rotate_tile(void *vargs, long start_i, long end_i, long start_j, long end_j){
+    struct transform_args *args = (struct transform_args *) vargs;
+    struct picture *pic = args->pic;
+    struct picture *src = args->tmp;
+    long width = src->width;
+    long height = src->height;
+    long base, step_i, step_j;
+
+    // determine rotation angle and the corresponding walk over the source
+    switch(args->angle){
+      case(90):
+        base = (height - 1) * width;
+        step_i = -width;
+        step_j = 1;
+        break;
+      case(180):
+        base = height * width - 1;
+        step_i = -1;
+        step_j = -width;
+        break;
+      default:
+        base = width - 1;
+        step_i = width;
+        step_j = -1;
+        break;
+    }
+
+    for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+      const float *src_plane = picture_row(src, c, 0) + base;
+      for(long j = start_j; j < end_j; j++){
+        float *dst = picture_row(pic, c, j);
+        const float *from = src_plane + j * step_j;
+        for(long i = start_i; i < end_i; i++){
+          dst[i] = quantise_intensity(from[i * step_i]);
+        }
       }
-    }    
+    }
   }
 
   void rotate_picture(struct picture *pic, int angle){
-    // make temporary copy of picture to work from
-    struct picture tmp;
-    tmp.img = copy_image(pic->img);
-    tmp.width = pic->width;
-    tmp.height = pic->height; 
-  
-    int new_width = tmp.width;
-    int new_height = tmp.height;
-  
+    // check the rotation angle before touching the picture
+    if(angle != 90 && angle != 180 && angle != 270){
+      printf("[!] rotate is undefined for angle %i (must be 90, 180 or 270)\n", angle);
+      exit(IO_ERROR);
+    }
+
+    bool compact = expand_compact_picture(pic);
+    int new_width = pic->width;
+    int new_height = pic->height;
+
     // adjust output picture size as necessary
     if(angle == 90 || angle == 270){
-      new_width = tmp.height;
-      new_height = tmp.width;
+      new_width = pic->height;
+      new_height = pic->width;
     }
-    clear_picture(pic);
-    init_picture_from_size(pic, new_width, new_height);
-  
-    // iterate over each pixel in the picture
-    for(int i = 0 ; i < new_width; i++){
-      for(int j = 0 ; j < new_height; j++){
-        struct pixel rgb;
-        // determine rotation angle and execute corresponding pixel update
-        switch(angle){
-          case(90):
-            rgb = get_pixel(&tmp, j, new_width -1 - i); 
-            break;
-          case(180):
-            rgb = get_pixel(&tmp, new_width - 1 - i, new_height - 1 - j);
-            break;
-          case(270):
-            rgb = get_pixel(&tmp, new_height - 1 - j, i);
-            break;
-          default:
-            printf("[!] rotate is undefined for angle %i (must be 90, 180 or 270)\n", angle);
-            clear_picture(&tmp);
-            exit(IO_ERROR);
+
+    // keep the original image as the source and write only the output
+    struct picture src;
+    begin_transform(pic, &src, new_width, new_height);
+
+    // rotate the output picture tile by tile in parallel
+    struct transform_args args = { pic, &src, angle };
+    thread_pool_parallel_for_2d(get_thread_pool(), 0, new_width, 0, new_height,
+                                ROTATE_TILE_SIZE, ROTATE_TILE_SIZE, &rotate_tile, &args);
+
+    // keep the original image as the back buffer
+    end_transform(pic, &src);
+    restore_compact_picture(pic, compact);
+  }
+
+  /* Mirrors rows [start_j, end_j) in place, swapping the pixel pairs (i, w - 1 - i). */
+  static void flip_h_rows(void *vargs, long start_j, long end_j){
+    struct picture *pic = ((struct transform_args *) vargs)->pic;
+
+    for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+      for(long j = start_j; j < end_j; j++){
+        float *row = picture_row(pic, c, j);
+        // a middle pixel of an odd width is swapped with itself
+        for(long i = 0, k = pic->width - 1; i <= k; i++, k--){
+          float left = row[i];
+          row[i] = quantise_intensity(row[k]);
+          row[k] = quantise_intensity(left);
         }
-        set_pixel(pic, i,j, &rgb);
       }
     }
-    
-    // temporary picture clean-up
-    clear_picture(&tmp);
   }
 
-  void flip_picture(struct picture *pic, char plane){
-    // make temporary copy of picture to work from
-    struct picture tmp;
-    tmp.img = copy_image(pic->img);
-    tmp.width = pic->width;
-    tmp.height = pic->height;  
-    
-    // iterate over each pixel in the picture
-    for(int i = 0 ; i < tmp.width; i++){
-      for(int j = 0 ; j < tmp.height; j++){    
-        struct pixel rgb;
-        // determine flip plane and execute corresponding pixel update
-        switch(plane){
-          case('V'):
-            rgb = get_pixel(&tmp, i, tmp.height - 1 - j);
-            break;
-          case('H'):
-            rgb = get_pixel(&tmp, tmp.width - 1 - i, j);
-            break;
-          default:
-            printf("[!] flip is undefined for plane %c\n", plane);
-            clear_picture(&tmp);
-            exit(IO_ERROR);
-        } 
-        set_pixel(pic, i, j, &rgb);
+  /* Swaps rows j and h - 1 - j in place for the row pairs [start_j, end_j). */
+  static void flip_v_row_pairs(void *vargs, long start_j, long end_j){
+    struct picture *pic = ((struct transform_args *) vargs)->pic;
+
+    for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+      for(long j = start_j; j < end_j; j++){
+        // a middle row of an odd height is swapped with itself
+        float *top = picture_row(pic, c, j);
+        float *bottom = picture_row(pic, c, pic->height - 1 - j);
+        for(long i = 0; i < pic->width; i++){
+          float value = top[i];
+          top[i] = quantise_intensity(bottom[i]);
+          bottom[i] = quantise_intensity(value);
+        }
       }
     }
+  }
 
-    // temporary picture clean-up
-    clear_picture(&tmp);
+  /* flip_h_rows for a compact picture, swapping whole interleaved pixels. */
+  static void flip_h_compact_rows(void *vargs, long start_j, long end_j){
+    struct picture *pic = ((struct transform_args *) vargs)->pic;
+
+    for(long j = start_j; j < end_j; j++){
+      uint8_t *row = compact_picture_row(pic, j);
+      for(long i = 0, k = pic->width - 1; i < k; i++, k--){
+        for(int c = 0; c < COMPACT_PIXEL_SIZE; c++){
+          uint8_t left = row[i * COMPACT_PIXEL_SIZE + c];
+          row[i * COMPACT_PIXEL_SIZE + c] = row[k * COMPACT_PIXEL_SIZE + c];
+          row[k * COMPACT_PIXEL_SIZE + c] = left;
+        }
+      }
+    }
+  }
+
+  /* flip_v_row_pairs for a compact picture. */
+  static void flip_v_compact_row_pairs(void *vargs, long start_j, long end_j){
+    struct picture *pic = ((struct transform_args *) vargs)->pic;
+    long row_size = (long) pic->width * COMPACT_PIXEL_SIZE;
+
+    for(long j = start_j; j < end_j; j++){
+      uint8_t *top = compact_picture_row(pic, j);
+      uint8_t *bottom = compact_picture_row(pic, pic->height - 1 - j);
+      for(long k = 0; k < row_size; k++){
+        uint8_t value = top[k];
+        top[k] = bottom[k];
+        bottom[k] = value;
+      }
+    }
+  }
+
+  void flip_picture(struct picture *pic, char plane){
+    // check the flip plane before touching the picture
+    if(plane != 'V' && plane != 'H'){
+      printf("[!] flip is undefined for plane %c\n", plane);
+      exit(IO_ERROR);
+    }
+
+    // flip the picture in place, each job owning whole rows (H) or row pairs (V)
+    struct transform_args args = { pic };
+    if(plane == 'V'){
+      long pairs = (pic->height + 1) / 2;
+      long min_pairs = ((MIN_PIXELS_PER_JOB + pic->width - 1) / pic->width + 1) / 2;
+      long grain = thread_pool_auto_grain(get_thread_pool(), pairs, min_pairs);
+      thread_pool_range_fn *pairs_fn = is_compact_picture(pic) ? &flip_v_compact_row_pairs : &flip_v_row_pairs;
+      thread_pool_parallel_for(get_thread_pool(), 0, pairs, grain, pairs_fn, &args);
+    } else {
+      thread_pool_range_fn *rows = is_compact_picture(pic) ? &flip_h_compact_rows : &flip_h_rows;
+      thread_pool_parallel_for(get_thread_pool(), 0, pic->height, row_grain(pic), rows, &args);
+    }
   }
 
   static void blur_individual_pixel(struct picture *pic, struct picture *tmp, int i, int j) {
@@ -147,12 +429,128 @@
     set_pixel(pic, i, j, &rgb);
   }
   
+  /* Blurs the non-boundary pixels of rows [start_j, end_j) as a separable box
+     blur over whole rows of each colour plane: horizontal sums of three pixels
+     are kept for a window of three rows, and running column sums of them are
+     slid down the rows. The integer sums and division match
+     blur_individual_pixel exactly. */
+  static void box_blur_rows(void *vargs, long start_j, long end_j){
+    struct transform_args *args = (struct transform_args *) vargs;
+    const struct pic_kernels *kernels = get_pic_kernels();
+    int width = args->pic->width;
+
+    if(width < 3 || start_j >= end_j){
+      return;
+    }
+
+    int *scratch = band_scratch(args->scratch, start_j);
+    // horizontal sums of the window's rows, row j kept in sums[j % 3]
+    int *sums[3] = { scratch, scratch + width, scratch + 2 * width };
+    int *column_sums = scratch + 3 * width;
+    int *intensities = scratch + 4 * width;
+
+    for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+      const float *src = picture_row(args->tmp, c, 0);
+      float *dst = picture_row(args->pic, c, 0);
+
+      // set up the window around the first row
+      for(int j = start_j - 1; j <= start_j + 1; j++){
+        kernels->quantise(src + j * width, intensities, width);
+        kernels->sum3(intensities, sums[j % 3], width);
+      }
+      memcpy(column_sums + 1, sums[0] + 1, (width - 2) * sizeof(int));
+      kernels->add(column_sums + 1, sums[1] + 1, width - 2);
+      kernels->add(column_sums + 1, sums[2] + 1, width - 2);
+
+      for(int j = start_j; j < end_j; j++){
+        if(j > start_j){
+          // slide the window down: row j + 1 takes the place of row j - 2
+          int *slot = sums[(j + 1) % 3];
+          kernels->sub(column_sums + 1, slot + 1, width - 2);
+          kernels->quantise(src + (j + 1) * width, intensities, width);
+          kernels->sum3(intensities, slot, width);
+          kernels->add(column_sums + 1, slot + 1, width - 2);
+        }
+
+        kernels->average(column_sums + 1, BLUR_REGION_SIZE, dst + j * width + 1, width - 2);
+      }
+    }
+  }
+
+  /* Index read in place of k, which is at most one pixel outside [0, n). */
+  static inline int border_index(int k, int n, enum blur_border border){
+    if(k < 0){
+      return border == BLUR_BORDER_MIRROR && n > 1 ? 1 : 0;
+    }
+    if(k >= n){
+      return border == BLUR_BORDER_MIRROR && n > 1 ? n - 2 : n - 1;
+    }
+    return k;
+  }
+
+  /* Blurs the boundary pixels of src into pic, reading the pixels outside
+     the picture as the border mode says. The interior is left to the
+     bounds-free box_blur_rows, so only this path ever remaps an index, and
+     it only covers the 2 * (width + height) pixels of the ring. */
+  static void blur_border_pixels(struct picture *pic, struct picture *src, enum blur_border border){
+    int width = pic->width;
+    int height = pic->height;
+
+    // the boundary pixels were carried over unchanged by begin_blur
+    if(border == BLUR_BORDER_SKIP){
+      return;
+    }
+
+    for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+      for(int j = 0; j < height; j++){
+        // the whole of the first and last rows, and both ends of the others
+        int step = (j == 0 || j == height - 1) ? 1 : width - 1;
+        for(int i = 0; i < width; i += step > 0 ? step : 1){
+          int sum = 0;
+          for(int n = -1; n <= 1; n++){
+            const float *row = picture_row(src, c, border_index(j + n, height, border));
+            for(int m = -1; m <= 1; m++){
+              sum += (int) (row[border_index(i + m, width, border)] * MAX_PIXEL_INTENSITY);
+            }
+          }
+          picture_row(pic, c, j)[i] = (sum / BLUR_REGION_SIZE) / MAX_PIXEL_INTENSITY;
+        }
+      }
+    }
+  }
+
   void blur_picture(struct picture *pic){
-    // make temporary copy of picture to work from
+    blur_picture_border(pic, BLUR_BORDER_SKIP);
+  }
+
+  /* Box blurs the picture, with the boundary pixels left unchanged or
+     blurred as if the picture extended past them as the border mode says. */
+  void blur_picture_border(struct picture *pic, enum blur_border border){
+    // read the picture as it stands while blurring into its back buffer
+    bool compact = expand_compact_picture(pic);
     struct picture tmp;
-    tmp.img = copy_image(pic->img);
-    tmp.width = pic->width;
-    tmp.height = pic->height;  
+    begin_blur(pic, &tmp);
+
+    // blur all the non-boundary rows in one go, then the boundary
+    struct band_scratch scratch = { NULL, 0 };
+    split_band_scratch(pic, &scratch, 1, tmp.height - 1, tmp.height - 2, BOX_BLUR_ROWS * pic->width);
+    struct transform_args args = { pic, &tmp, 0, &scratch };
+    box_blur_rows(&args, 1, tmp.height - 1);
+    blur_border_pixels(pic, &tmp, border);
+
+    // keep the original image as the back buffer, and the scratch with it
+    end_transform(pic, &tmp);
+    return_band_scratch(pic, &scratch);
+    restore_compact_picture(pic, compact);
+  }
+
+  /* Blurs the picture one pixel at a time, reading each pixel's 3x3 region
+     through get_pixel. Kept as the reference for the faster blurs. */
+  void naive_blur_picture(struct picture *pic){
+    // read the picture as it stands while blurring into its back buffer
+    bool compact = expand_compact_picture(pic);
+    struct picture tmp;
+    begin_blur(pic, &tmp);
   
     // iterate over each pixel in the picture (ignoring boundary pixels)
     for(int i = 1 ; i < tmp.width - 1; i++){
@@ -161,288 +559,527 @@
       }
     }
     
-    // temporary picture clean-up
-    clear_picture(&tmp);
+    // keep the original image as the back buffer
+    end_transform(pic, &tmp);
+    restore_compact_picture(pic, compact);
   }
 
-  struct blur_pixel_args {
-    struct picture *pic;
-    struct picture *tmp;
-    int i;
-    int j;
-  };
+  /* Blurs every pixel in the tile [start_i, end_i) x [start_j, end_j). */
+  static void blur_tile(void *vargs, long start_i, long end_i, long start_j, long end_j){
+    struct transform_args *args = (struct transform_args *) vargs;
 
-  void *thread_blur_pixel(void *vargs) {
-    struct blur_pixel_args *args = (struct blur_pixel_args *) vargs;
-    struct picture *pic = args->pic;
-    struct picture *tmp = args->tmp;
-    int i = args->i;
-    int j = args->j;
+    for(int i = start_i; i < end_i; i++){
+      for(int j = start_j; j < end_j; j++){
+        blur_individual_pixel(args->pic, args->tmp, i, j);
+      }
+    }
+  }
 
-    blur_individual_pixel(pic, tmp, i, j);
-    
-    free(vargs);
-    return NULL;
+  /* Blurs the non-boundary pixels of rows [start_j, end_j). */
+  static void blur_rows(void *vargs, long start_j, long end_j){
+    struct transform_args *args = (struct transform_args *) vargs;
+    blur_tile(vargs, 1, args->tmp->width - 1, start_j, end_j);
   }
-  
-  /* Uses a thread pool to parallelise blurring pixel by pixel. */
-  void parallel_blur_picture(struct picture *pic){
-    // make temporary copy of picture to work from
-    struct picture tmp;
-    tmp.img = copy_image(pic->img);
-    tmp.width = pic->width;
-    tmp.height = pic->height; 
 
-    thread_pool_t tpool;
-    thread_pool_init(&tpool, THREAD_POOL_DEFAULT_THREADS, (pic->width - 2) * (pic->height - 2));
+  /* Blurs the non-boundary pixels of columns [start_i, end_i). */
+  static void blur_columns(void *vargs, long start_i, long end_i){
+    struct transform_args *args = (struct transform_args *) vargs;
+    blur_tile(vargs, start_i, end_i, 1, args->tmp->height - 1);
+  }
 
-    // iterate over each pixel in the picture (ignoring boundary pixels)
-    for(int i = 1 ; i < tmp.width - 1; i++){
-      for(int j = 1 ; j < tmp.height - 1; j++){
-        struct blur_pixel_args *args = malloc(sizeof(struct blur_pixel_args));
-        args->pic = pic;
-        args->tmp = &tmp;
-        args->i = i;
-        args->j = j;
-        thread_pool_submit_job(&tpool, &thread_blur_pixel, args);
-      }
-    }
+  /* Runs a parallel blur over the non-boundary pixels of the picture, split
+     into tiles of at most grain_i by grain_j pixels (0 picks the tile size
+     from the picture size and core count). */
+  static void parallel_tiled_blur_picture(struct picture *pic, long grain_i, long grain_j){
+    // read the picture as it stands while blurring into its back buffer
+    bool compact = expand_compact_picture(pic);
+    struct picture tmp;
+    begin_blur(pic, &tmp);
 
-    thread_pool_run_and_wait(&tpool);
-    thread_pool_destroy(&tpool);
+    struct transform_args args = { pic, &tmp };
+    thread_pool_parallel_for_2d(get_thread_pool(), 1, tmp.width - 1, 1, tmp.height - 1,
+                                grain_i, grain_j, &blur_tile, &args);
 
-    // temporary picture clean-up
-    clear_picture(&tmp);
+    // keep the original image as the back buffer
+    end_transform(pic, &tmp);
+    restore_compact_picture(pic, compact);
   }
 
-  struct blur_row_args {
-    struct picture *pic;
-    struct picture *tmp;
-    int j;
-  };
+  /* Uses a thread pool to parallelise the box blur over bands of rows. */
+  void parallel_blur_picture(struct picture *pic){
+    parallel_blur_picture_border(pic, BLUR_BORDER_SKIP);
+  }
 
-  void *thread_blur_row(void *vargs) {
-    struct blur_row_args *args = (struct blur_row_args *) vargs;
-    struct picture *pic = args->pic;
-    struct picture *tmp = args->tmp;
-    int j = args->j;
+  /* parallel_blur_picture with the boundary treated as the border mode says. */
+  void parallel_blur_picture_border(struct picture *pic, enum blur_border border){
+    // read the picture as it stands while blurring into its back buffer
+    bool compact = expand_compact_picture(pic);
+    struct picture tmp;
+    begin_blur(pic, &tmp);
 
-    for(int i = 1; i < tmp->width - 1; i++) {
-      blur_individual_pixel(pic, tmp, i, j);
+    // every band recomputes the sums of the two rows around it, so bands are
+    // kept tall enough for that to be negligible
+    long min_rows = (MIN_PIXELS_PER_JOB + pic->width - 1) / pic->width;
+    if(min_rows < MIN_BLUR_ROWS_PER_JOB){
+      min_rows = MIN_BLUR_ROWS_PER_JOB;
     }
+    long grain = thread_pool_auto_grain(get_thread_pool(), tmp.height - 2, min_rows);
+
+    struct band_scratch scratch = { NULL, 0 };
+    split_band_scratch(pic, &scratch, 1, tmp.height - 1, grain, BOX_BLUR_ROWS * pic->width);
+    struct transform_args args = { pic, &tmp, 0, &scratch };
+    thread_pool_parallel_for(get_thread_pool(), 1, tmp.height - 1, grain, &box_blur_rows, &args);
+    blur_border_pixels(pic, &tmp, border);
+
+    // keep the original image as the back buffer, and the scratch with it
+    end_transform(pic, &tmp);
+    return_band_scratch(pic, &scratch);
+    restore_compact_picture(pic, compact);
+  }
 
-    free(vargs);
-    return NULL;
+  /* Uses a thread pool to parallelise blurring over tiles sized to the picture and core count. */
+  void parallel_tile_blur_picture(struct picture *pic){
+    parallel_tiled_blur_picture(pic, 0, 0);
+  }
+  
+  /* Uses a thread pool to parallelise blurring pixel by pixel. */
+  void parallel_pixel_blur_picture(struct picture *pic){
+    parallel_tiled_blur_picture(pic, 1, 1);
   }
 
   /* Uses a thread pool to parallelise blurring row by row. */
   void parallel_row_blur_picture(struct picture *pic){
-    // make temporary copy of picture to work from
+    // read the picture as it stands while blurring into its back buffer
+    bool compact = expand_compact_picture(pic);
     struct picture tmp;
-    tmp.img = copy_image(pic->img);
-    tmp.width = pic->width;
-    tmp.height = pic->height; 
-
-    thread_pool_t tpool;
-    thread_pool_init(&tpool, THREAD_POOL_DEFAULT_THREADS, pic->height - 2);
+    begin_blur(pic, &tmp);
 
     // iterate over each row in the picture (ignoring boundary rows)
-    for(int j = 1; j < tmp.height - 1; j++){
-      struct blur_row_args *args = malloc(sizeof(struct blur_row_args));
-      args->pic = pic;
-      args->tmp = &tmp;
-      args->j = j;
-      thread_pool_submit_job(&tpool, &thread_blur_row, args);
+    struct transform_args args = { pic, &tmp };
+    thread_pool_parallel_for(get_thread_pool(), 1, tmp.height - 1, 1, &blur_rows, &args);
+
+    // keep the original image as the back buffer
+    end_transform(pic, &tmp);
+    restore_compact_picture(pic, compact);
+  }
+
+  /* Uses a thread pool to parallelise blurring column by column. */
+  void parallel_column_blur_picture(struct picture *pic){
+    // read the picture as it stands while blurring into its back buffer
+    bool compact = expand_compact_picture(pic);
+    struct picture tmp;
+    begin_blur(pic, &tmp);
+
+    // iterate over each column in the picture (ignoring boundary columns)
+    struct transform_args args = { pic, &tmp };
+    thread_pool_parallel_for(get_thread_pool(), 1, tmp.width - 1, 1, &blur_columns, &args);
+
+    // keep the original image as the back buffer
+    end_transform(pic, &tmp);
+    restore_compact_picture(pic, compact);
+  }
+
+  /* Uses a thread pool to parallelise blurring each vertical half of the picture per thread. */
+  void parallel_v_half_sector_blur_picture(struct picture *pic){
+    parallel_tiled_blur_picture(pic, (pic->width - 1) / 2, pic->height);
+  }
+
+  /* Uses a thread pool to parallelise blurring each horizontal half of the picture per thread. */
+  void parallel_h_half_sector_blur_picture(struct picture *pic){
+    parallel_tiled_blur_picture(pic, pic->width, (pic->height - 1) / 2);
+  }
+
+  /* Uses a thread pool to parallelise blurring the four corner 
+     segments of the picture per thread. */
+  void parallel_quarter_sector_blur_picture(struct picture *pic){
+    parallel_tiled_blur_picture(pic, (pic->width - 1) / 2, (pic->height - 1) / 2);
+  }
+
+  /* Reads rows [start_j, end_j) of the plane into src as the integer values
+     get_pixel would return. */
+  static void load_plane_rows(void *vargs, long start_j, long end_j){
+    struct plane_blur_args *args = (struct plane_blur_args *) vargs;
+    long offset = start_j * args->width;
+
+    get_pic_kernels()->quantise(args->plane + offset, args->src + offset, (end_j - start_j) * args->width);
+  }
+
+  /* Writes rows [start_j, end_j) of dst back into the plane as set_pixel
+     would, leaving the pixels the blur skipped untouched. */
+  static void store_plane_rows(void *vargs, long start_j, long end_j){
+    struct plane_blur_args *args = (struct plane_blur_args *) vargs;
+    int r = args->clip ? 0 : args->radius;
+
+    for(long j = start_j; j < end_j; j++){
+      if(j < r || j >= args->height - r){
+        continue;
+      }
+      for(long i = r; i < args->width - r; i++){
+        args->plane[j * args->width + i] = args->dst[j * args->width + i] / MAX_PIXEL_INTENSITY;
+      }
     }
+  }
 
-    thread_pool_run_and_wait(&tpool);
-    thread_pool_destroy(&tpool);
+  /* Fills rows [start_j, end_j) of the summed-area table with prefix sums
+     along each row of src. Row 0 and column 0 of the table stay zero. */
+  static void table_row_sums(void *vargs, long start_j, long end_j){
+    struct plane_blur_args *args = (struct plane_blur_args *) vargs;
+    int stride = args->width + 1;
 
-    // temporary picture clean-up
-    clear_picture(&tmp);
+    for(long j = start_j; j < end_j; j++){
+      const int *row = args->src + j * args->width;
+      long *sums = args->table + (j + 1) * stride;
+      sums[0] = 0;
+      for(int i = 0; i < args->width; i++){
+        sums[i + 1] = sums[i] + row[i];
+      }
+    }
   }
 
-  struct blur_column_args {
-    struct picture *pic;
-    struct picture *tmp;
-    int i;
-  };
+  /* Accumulates the row sums of table columns [start_i, end_i) down the
+     table, walking along rows so that each job reads memory in order. */
+  static void table_column_sums(void *vargs, long start_i, long end_i){
+    struct plane_blur_args *args = (struct plane_blur_args *) vargs;
+    int stride = args->width + 1;
 
-  void *thread_blur_column(void *vargs) {
-    struct blur_column_args *args = (struct blur_column_args *) vargs;
-    struct picture *pic = args->pic;
-    struct picture *tmp = args->tmp;
-    int i = args->i;
+    for(int j = 2; j <= args->height; j++){
+      long *sums = args->table + j * stride;
+      for(long i = start_i; i < end_i; i++){
+        sums[i] += sums[i - stride];
+      }
+    }
+  }
+
+  /* Averages the (2 * radius + 1) square window around each pixel of rows
+     [start_j, end_j) with four table look-ups, whatever the radius. */
+  static void table_blur_rows(void *vargs, long start_j, long end_j){
+    struct plane_blur_args *args = (struct plane_blur_args *) vargs;
+    int stride = args->width + 1;
+    int r = args->radius;
 
-    for(int j = 1; j < tmp->height - 1; j++) {
-      blur_individual_pixel(pic, tmp, i, j);
+    for(long j = start_j; j < end_j; j++){
+      int y0 = j - r < 0 ? 0 : j - r;
+      int y1 = j + r + 1 > args->height ? args->height : j + r + 1;
+      const long *top = args->table + y0 * stride;
+      const long *bottom = args->table + y1 * stride;
+
+      for(int i = 0; i < args->width; i++){
+        int x0 = i - r < 0 ? 0 : i - r;
+        int x1 = i + r + 1 > args->width ? args->width : i + r + 1;
+        long count = (long) (x1 - x0) * (y1 - y0);
+        long sum = bottom[x1] - bottom[x0] - top[x1] + top[x0];
+
+        if(args->clip){
+          // rounded, so that repeated passes do not darken the picture
+          args->dst[j * args->width + i] = (sum + count / 2) / count;
+        } else {
+          // only whole windows are used, truncated like blur_picture
+          args->dst[j * args->width + i] = sum / count;
+        }
+      }
     }
+  }
 
-    free(vargs);
-    return NULL;
+  /* Box blurs src into dst with the given radius: builds the summed-area
+     table of src a band of rows and then a band of columns at a time, and
+     reads every window average straight off it. */
+  static void table_box_pass(struct plane_blur_args *args, int radius){
+    thread_pool_t *tpool = get_thread_pool();
+    long row_grain = thread_pool_auto_grain(tpool, args->height, 1);
+    long column_grain = thread_pool_auto_grain(tpool, args->width, MIN_COLUMNS_PER_JOB);
+
+    args->radius = radius;
+    thread_pool_parallel_for(tpool, 0, args->height, row_grain, &table_row_sums, args);
+    thread_pool_parallel_for(tpool, 1, args->width + 1, column_grain, &table_column_sums, args);
+    thread_pool_parallel_for(tpool, 0, args->height, row_grain, &table_blur_rows, args);
   }
 
-  /* Uses a thread pool to parallelise blurring column by column. */
-  void parallel_column_blur_picture(struct picture *pic){
-    // make temporary copy of picture to work from
-    struct picture tmp;
-    tmp.img = copy_image(pic->img);
-    tmp.width = pic->width;
-    tmp.height = pic->height; 
+  /* Blurs each colour plane with a sequence of box blurs of the given radii,
+     applied to the integer intensities before storing the result. */
+  static void table_blur_picture(struct picture *pic, const int *radii, int passes, bool clip){
+    long pixels = (long) pic->width * pic->height;
+    struct plane_blur_args args;
+    args.src = malloc(pixels * sizeof(int));
+    args.dst = malloc(pixels * sizeof(int));
+    args.table = calloc((pic->width + 1) * (pic->height + 1), sizeof(long));
+    args.width = pic->width;
+    args.height = pic->height;
+    args.clip = clip;
 
-    thread_pool_t tpool;
-    thread_pool_init(&tpool, THREAD_POOL_DEFAULT_THREADS, pic->width - 2);
+    thread_pool_t *tpool = get_thread_pool();
+    long grain = row_grain(pic);
 
-    // iterate over each row in the picture (ignoring boundary rows)
-    for(int i = 1; i < tmp.width - 1; i++){
-      struct blur_column_args *args = malloc(sizeof(struct blur_column_args));
-      args->pic = pic;
-      args->tmp = &tmp;
-      args->i = i;
-      thread_pool_submit_job(&tpool, &thread_blur_column, args);
+    for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+      args.plane = picture_row(pic, c, 0);
+      thread_pool_parallel_for(tpool, 0, pic->height, grain, &load_plane_rows, &args);
+
+      for(int pass = 0; pass < passes; pass++){
+        if(pass > 0){
+          int *blurred = args.dst;
+          args.dst = args.src;
+          args.src = blurred;
+        }
+        table_box_pass(&args, radii[pass]);
+      }
+
+      thread_pool_parallel_for(tpool, 0, pic->height, grain, &store_plane_rows, &args);
     }
 
-    thread_pool_run_and_wait(&tpool);
-    thread_pool_destroy(&tpool);
+    free(args.table);
+    free(args.dst);
+    free(args.src);
+  }
 
-    // temporary picture clean-up
-    clear_picture(&tmp);
+  /* Blurs the picture with a (2 * radius + 1) square box at the same cost per
+     pixel for any radius, using summed-area tables. As with blur_picture,
+     pixels closer than radius to the boundary are left unchanged, so radius 1
+     gives exactly the same picture as blur_picture. */
+  void blur_picture_radius(struct picture *pic, int radius){
+    if(radius <= 0 || pic->width <= 2 * radius || pic->height <= 2 * radius){
+      return;
+    }
+    bool compact = expand_compact_picture(pic);
+    table_blur_picture(pic, &radius, 1, false);
+    restore_compact_picture(pic, compact);
   }
-  
-  struct blur_sector_args {
-    struct picture *pic;
-    struct picture *tmp;
-    int start_i;
-    int end_i;
-    int start_j;
-    int end_j;
-  };
 
-  static void blur_sector_args_init(struct blur_sector_args *args, 
-                                     struct picture *pic,
-                                     struct picture *tmp,
-                                     int start_i,
-                                     int end_i,
-                                     int start_j,
-                                     int end_j) {
-    args->pic = pic;
-    args->tmp = tmp;
-    args->start_i = start_i;
-    args->end_i = end_i;
-    args->start_j = start_j;
-    args->end_j = end_j;
-  }
-
-  void *thread_blur_sector(void *vargs) {
-    struct blur_sector_args *args = (struct blur_sector_args *) vargs;
-    struct picture *pic = args->pic;
-    struct picture *tmp = args->tmp;
-    int start_i = args->start_i;
-    int end_i = args->end_i;
-    int start_j = args->start_j;
-    int end_j = args->end_j;
+  /* Approximates a Gaussian blur with standard deviation sigma by
+     GAUSSIAN_BOX_PASSES box blurs, each with the cost of blur_picture_radius
+     whatever their size. Near the boundary the windows are clipped to the
+     picture, so every pixel is blurred. */
+  void gaussian_blur_picture(struct picture *pic, double sigma){
+    if(sigma <= 0){
+      return;
+    }
 
-    for(int i = start_i; i < end_i; i++){
-      for(int j = start_j; j < end_j; j++){
-        blur_individual_pixel(pic, tmp, i, j);
+    // Picks odd box widths w and w + 2 whose passes add up to the variance
+    // sigma^2 (a box of width w has variance (w^2 - 1) / 12).
+    int n = GAUSSIAN_BOX_PASSES;
+    int lower = sqrt(12 * sigma * sigma / n + 1);
+    if(lower % 2 == 0){
+      lower--;
+    }
+    int upper = lower + 2;
+    int lower_passes = round((12 * sigma * sigma - n * lower * lower - 4 * n * lower - 3 * n)
+                             / (-4 * lower - 4));
+
+    int radii[GAUSSIAN_BOX_PASSES];
+    for(int pass = 0; pass < n; pass++){
+      radii[pass] = ((pass < lower_passes ? lower : upper) - 1) / 2;
+    }
+    bool compact = expand_compact_picture(pic);
+    table_blur_picture(pic, radii, n, true);
+    restore_compact_picture(pic, compact);
+  }
+
+// -------------- fused picture pipelines -------------- \\
+
+  static bool is_point_op(const struct pipeline_op *op){
+    return op->type == PIPELINE_INVERT || op->type == PIPELINE_GRAYSCALE;
+  }
+
+  /* Applies the point operations in turn to n pixels held as integer
+     intensities, exactly as the transformations would one pass at a time. */
+  static void apply_point_ops(const struct pipeline_op *ops, int num_ops, int *rgb[], long n){
+    for(int o = 0; o < num_ops; o++){
+      if(ops[o].type == PIPELINE_INVERT){
+        for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+          get_pic_kernels()->invert_intensities(rgb[c], n);
+        }
+      } else {
+        get_pic_kernels()->grayscale_intensities(rgb[0], rgb[1], rgb[2], n);
       }
     }
+  }
+
+  /* Reads row j of the picture as integer intensities and applies ops to it. */
+  static void load_pipeline_row(struct picture *pic, long j, const struct pipeline_op *ops, int num_ops,
+                                int *rgb[]){
+    for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+      get_pic_kernels()->quantise(picture_row(pic, c, j), rgb[c], pic->width);
+    }
+    apply_point_ops(ops, num_ops, rgb, pic->width);
+  }
 
-    free(vargs);
-    return NULL;
+  /* Applies ops to a row of integer intensities and writes it to row j of the picture. */
+  static void store_pipeline_row(struct picture *pic, long j, const struct pipeline_op *ops, int num_ops,
+                                 int *rgb[]){
+    apply_point_ops(ops, num_ops, rgb, pic->width);
+    for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+      get_pic_kernels()->dequantise(rgb[c], picture_row(pic, c, j), pic->width);
+    }
   }
 
-  /* Uses a thread pool to parallelise blurring each vertical half of the picture per thread. */
-  void parallel_v_half_sector_blur_picture(struct picture *pic){
-    // make temporary copy of picture to work from
-    struct picture tmp;
-    tmp.img = copy_image(pic->img);
-    tmp.width = pic->width;
-    tmp.height = pic->height; 
+  /* Runs the point operations of a pass without a blur over rows [start_j, end_j), in place. */
+  static void point_pass_rows(void *vargs, long start_j, long end_j){
+    struct pipeline_pass_args *args = (struct pipeline_pass_args *) vargs;
+    int width = args->pic->width;
+
+    int *scratch = band_scratch(args->scratch, start_j);
+    int *rgb[NO_RGB_COMPONENTS] = { scratch, scratch + width, scratch + 2 * width };
 
-    thread_pool_t tpool;
-    thread_pool_init(&tpool, THREAD_POOL_DEFAULT_THREADS, pic->width - 2);
+    for(long j = start_j; j < end_j; j++){
+      load_pipeline_row(args->pic, j, args->pre_ops, args->num_pre_ops, rgb);
+      store_pipeline_row(args->pic, j, NULL, 0, rgb);
+    }
+  }
 
-    /* Prepare and submit job for left side of the image. */
-    struct blur_sector_args *left_args = malloc(sizeof(struct blur_sector_args));
-    blur_sector_args_init(left_args, pic, &tmp, 1, (tmp.width - 1) / 2, 1, tmp.height - 1);
-    thread_pool_submit_job(&tpool, &thread_blur_sector, left_args);
+  /* Runs a pass with a blur over output rows [start_j, end_j). The source rows
+     are streamed through a rolling buffer of three rows: each is read once,
+     has the pre-blur operations applied and its horizontal sums of three
+     pixels taken, and the output rows are averaged from the three around
+     them and have the post-blur operations applied before being stored. As
+     with blur_picture, the boundary pixels are not blurred. */
+  static void blur_pass_rows(void *vargs, long start_j, long end_j){
+    struct pipeline_pass_args *args = (struct pipeline_pass_args *) vargs;
+    const struct pic_kernels *kernels = get_pic_kernels();
+    int width = args->pic->width;
+    int height = args->pic->height;
 
-    /* Prepare and submit job for right side of the image. */
-    struct blur_sector_args *right_args = malloc(sizeof(struct blur_sector_args));
-    blur_sector_args_init(right_args, pic, &tmp, (tmp.width - 1) / 2, tmp.width - 1, 1, tmp.height - 1);
-    thread_pool_submit_job(&tpool, &thread_blur_sector, right_args);
+    // three source rows and their horizontal sums, row j kept in slot j % 3,
+    // then the output row
+    int *scratch = band_scratch(args->scratch, start_j);
+    int *rows[3][NO_RGB_COMPONENTS];
+    int *sums[3][NO_RGB_COMPONENTS];
+    int *out[NO_RGB_COMPONENTS];
+    for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+      for(int slot = 0; slot < 3; slot++){
+        rows[slot][c] = scratch + (slot * NO_RGB_COMPONENTS + c) * width;
+        sums[slot][c] = scratch + ((3 + slot) * NO_RGB_COMPONENTS + c) * width;
+      }
+      out[c] = scratch + (6 * NO_RGB_COMPONENTS + c) * width;
+    }
 
-    thread_pool_run_and_wait(&tpool);
-    thread_pool_destroy(&tpool);
+    // last source row read into the buffer
+    long loaded = (start_j > 0 ? start_j - 1 : 0) - 1;
+    for(long j = start_j; j < end_j; j++){
+      while(loaded < j + 1 && loaded < height - 1){
+        loaded++;
+        load_pipeline_row(args->src, loaded, args->pre_ops, args->num_pre_ops, rows[loaded % 3]);
+        for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+          int *row = rows[loaded % 3][c];
+          int *row_sums = sums[loaded % 3][c];
+          kernels->sum3(row, row_sums, width);
+          // the sums at either end take the pixels outside from the border mode
+          if(args->border != BLUR_BORDER_SKIP){
+            for(int i = 0; i < width; i += width > 1 ? width - 1 : 1){
+              row_sums[i] = row[border_index(i - 1, width, args->border)] + row[i]
+                            + row[border_index(i + 1, width, args->border)];
+            }
+          }
+        }
+      }
 
-    // temporary picture clean-up
-    clear_picture(&tmp);
+      for(int c = 0; c < NO_RGB_COMPONENTS; c++){
+        int *row = rows[j % 3][c];
+        if(args->border != BLUR_BORDER_SKIP){
+          // every pixel is blurred, the rows outside taken from the border mode
+          int above = border_index(j - 1, height, args->border);
+          int below = border_index(j + 1, height, args->border);
+          memcpy(out[c], sums[above % 3][c], width * sizeof(int));
+          kernels->add(out[c], sums[j % 3][c], width);
+          kernels->add(out[c], sums[below % 3][c], width);
+          kernels->divide(out[c], BLUR_REGION_SIZE, width);
+          continue;
+        }
+        if(j == 0 || j == height - 1 || width < 3){
+          memcpy(out[c], row, width * sizeof(int));
+          continue;
+        }
+        out[c][0] = row[0];
+        out[c][width - 1] = row[width - 1];
+        memcpy(out[c] + 1, sums[(j - 1) % 3][c] + 1, (width - 2) * sizeof(int));
+        kernels->add(out[c] + 1, sums[j % 3][c] + 1, width - 2);
+        kernels->add(out[c] + 1, sums[(j + 1) % 3][c] + 1, width - 2);
+        kernels->divide(out[c] + 1, BLUR_REGION_SIZE, width - 2);
+      }
+      store_pipeline_row(args->pic, j, args->post_ops, args->num_post_ops, out);
+    }
   }
 
-  /* Uses a thread pool to parallelise blurring each horizontal half of the picture per thread. */
-  void parallel_h_half_sector_blur_picture(struct picture *pic){
-    // make temporary copy of picture to work from
-    struct picture tmp;
-    tmp.img = copy_image(pic->img);
-    tmp.width = pic->width;
-    tmp.height = pic->height; 
+  /* Runs one fused pass over the picture on the thread pool, in bands of rows. */
+  static void run_pipeline_pass(struct pipeline_pass_args *args){
+    struct picture *pic = args->pic;
 
-    thread_pool_t tpool;
-    thread_pool_init(&tpool, THREAD_POOL_DEFAULT_THREADS, pic->width - 2);
+    if(!args->blur){
+      long grain = row_grain(pic);
+      split_band_scratch(pic, args->scratch, 0, pic->height, grain, NO_RGB_COMPONENTS * pic->width);
+      thread_pool_parallel_for(get_thread_pool(), 0, pic->height, grain, &point_pass_rows, args);
+      return;
+    }
 
-    /* Prepare and submit job for top side of the image. */
-    struct blur_sector_args *top_args = malloc(sizeof(struct blur_sector_args));
-    blur_sector_args_init(top_args, pic, &tmp, 1, tmp.width - 1, 1, (tmp.height - 1) / 2);
-    thread_pool_submit_job(&tpool, &thread_blur_sector, top_args);
+    // blur from the original image into the back buffer
+    struct picture src;
+    begin_transform(pic, &src, pic->width, pic->height);
+    args->src = &src;
 
-    /* Prepare and submit job for bottom side of the image. */
-    struct blur_sector_args *bottom_args = malloc(sizeof(struct blur_sector_args));
-    blur_sector_args_init(bottom_args, pic, &tmp, 1, tmp.width - 1, (tmp.height - 1) / 2, tmp.height - 1);
-    thread_pool_submit_job(&tpool, &thread_blur_sector, bottom_args);
+    // every band reads the two source rows around it again, so bands are
+    // kept tall enough for that to be negligible
+    long min_rows = (MIN_PIXELS_PER_JOB + pic->width - 1) / pic->width;
+    if(min_rows < MIN_BLUR_ROWS_PER_JOB){
+      min_rows = MIN_BLUR_ROWS_PER_JOB;
+    }
+    long grain = thread_pool_auto_grain(get_thread_pool(), pic->height, min_rows);
+    split_band_scratch(pic, args->scratch, 0, pic->height, grain,
+                       PIPELINE_BLUR_ROWS * NO_RGB_COMPONENTS * pic->width);
+    thread_pool_parallel_for(get_thread_pool(), 0, pic->height, grain, &blur_pass_rows, args);
 
-    thread_pool_run_and_wait(&tpool);
-    thread_pool_destroy(&tpool);
+    // keep the original image as the back buffer
+    end_transform(pic, &src);
+  }
 
-    // temporary picture clean-up
-    clear_picture(&tmp);
+  /* Runs an operation that is not fused with its neighbours on its own. */
+  static void run_pipeline_op(struct picture *pic, const struct pipeline_op *op){
+    switch(op->type){
+      case(PIPELINE_ROTATE):
+        rotate_picture(pic, op->param);
+        break;
+      case(PIPELINE_FLIP):
+        flip_picture(pic, op->plane);
+        break;
+      case(PIPELINE_BLUR_RADIUS):
+        blur_picture_radius(pic, op->param);
+        break;
+      case(PIPELINE_GAUSSIAN_BLUR):
+        gaussian_blur_picture(pic, op->param);
+        break;
+      default:
+        break;
+    }
   }
 
-  /* Uses a thread pool to parallelise blurring the four corner 
-     segments of the picture per thread. */
-  void parallel_quarter_sector_blur_picture(struct picture *pic){
-    // make temporary copy of picture to work from
-    struct picture tmp;
-    tmp.img = copy_image(pic->img);
-    tmp.width = pic->width;
-    tmp.height = pic->height; 
-
-    thread_pool_t tpool;
-    thread_pool_init(&tpool, THREAD_POOL_DEFAULT_THREADS, pic->width - 2);
-
-    /* Prepare and submit job for top left side of the image. */
-    struct blur_sector_args *top_left_args = malloc(sizeof(struct blur_sector_args));
-    blur_sector_args_init(top_left_args, pic, &tmp, 1, (tmp.width - 1) / 2, 1, (tmp.height - 1) / 2);
-    thread_pool_submit_job(&tpool, &thread_blur_sector, top_left_args);
-
-    /* Prepare and submit job for bottom left side of the image. */
-    struct blur_sector_args *bottom_left_args = malloc(sizeof(struct blur_sector_args));
-    blur_sector_args_init(bottom_left_args, pic, &tmp, 1, (tmp.width - 1) / 2, (tmp.height - 1) / 2, tmp.height - 1);
-    thread_pool_submit_job(&tpool, &thread_blur_sector, bottom_left_args);
-
-    /* Prepare and submit job for top right side of the image. */
-    struct blur_sector_args *top_right_args = malloc(sizeof(struct blur_sector_args));
-    blur_sector_args_init(top_right_args, pic, &tmp, (tmp.width - 1) / 2, tmp.width - 1, 1, (tmp.height - 1) / 2);
-    thread_pool_submit_job(&tpool, &thread_blur_sector, top_right_args);
-
-    /* Prepare and submit job for bottom right side of the image. */
-    struct blur_sector_args *bottom_right_args = malloc(sizeof(struct blur_sector_args));
-    blur_sector_args_init(bottom_right_args, pic, &tmp, (tmp.width - 1) / 2, tmp.width - 1, (tmp.height - 1) / 2, tmp.height - 1);
-    thread_pool_submit_job(&tpool, &thread_blur_sector, bottom_right_args);
-
-    thread_pool_run_and_wait(&tpool);
-    thread_pool_destroy(&tpool);
-
-    // temporary picture clean-up
-    clear_picture(&tmp);
+  /* Applies the operations to the picture in order. Each run of point
+     operations, the blur following it and the point operations following
+     that are fused into a single pass over the picture, working on whole
+     rows of integer intensities; the other operations each run on their own.
+     The result is exactly that of applying the operations one at a time. */
+  void run_picture_pipeline(struct picture *pic, const struct pipeline_op *ops, int num_ops){
+    // a compact picture is expanded once for the whole chain, and the passes
+    // share one scratch
+    bool compact = expand_compact_picture(pic);
+    struct band_scratch scratch = { NULL, 0 };
+    int o = 0;
+    while(o < num_ops){
+      if(!is_point_op(&ops[o]) && ops[o].type != PIPELINE_BLUR){
+        run_pipeline_op(pic, &ops[o]);
+        o++;
+        continue;
+      }
+
+      struct pipeline_pass_args args = { pic, pic, &ops[o], 0, NULL, 0, false, BLUR_BORDER_SKIP, &scratch };
+      for(; o < num_ops && is_point_op(&ops[o]); o++){
+        args.num_pre_ops++;
+      }
+      if(o < num_ops && ops[o].type == PIPELINE_BLUR){
+        args.blur = true;
+        args.border = ops[o].border;
+        args.post_ops = &ops[++o];
+        for(; o < num_ops && is_point_op(&ops[o]); o++){
+          args.num_post_ops++;
+        }
+      }
+      run_pipeline_pass(&args);
+    }
+    return_band_scratch(pic, &scratch);
+    restore_compact_picture(pic, compact);
   }
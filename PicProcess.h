@@ -3,6 +3,41 @@
 
 #include "Picture.h"
 #include "Utils.h"
+#include "ThreadPool.h"
+
+  // how a blur treats the pixels whose 3x3 region leaves the picture
+  enum blur_border {
+    // leave them unchanged
+    BLUR_BORDER_SKIP,
+    // read the nearest pixel inside the picture in place of those outside
+    BLUR_BORDER_REPLICATE,
+    // read the pixel reflected across the boundary pixel (index -1 reads 1)
+    BLUR_BORDER_MIRROR
+  };
+
+  // operations that can be chained in a picture pipeline
+  enum pipeline_op_type {
+    PIPELINE_INVERT,
+    PIPELINE_GRAYSCALE,
+    PIPELINE_BLUR,
+    PIPELINE_ROTATE,
+    PIPELINE_FLIP,
+    PIPELINE_BLUR_RADIUS,
+    PIPELINE_GAUSSIAN_BLUR
+  };
+
+  struct pipeline_op {
+    enum pipeline_op_type type;
+    // angle of a rotate, radius of a blur radius or sigma of a gaussian blur
+    double param;
+    // plane of a flip
+    char plane;
+    // border mode of a blur
+    enum blur_border border;
+  };
+
+  // thread pool used by the parallel transformations (defaults to a shared pool)
+  void set_picture_thread_pool(thread_pool_t *tpool);
   
   // picture transformation routines
   void invert_picture(struct picture *pic);
@@ -10,12 +45,22 @@
   void rotate_picture(struct picture *pic, int angle);
   void flip_picture(struct picture *pic, char plane);
   void blur_picture(struct picture *pic);
+  void blur_picture_border(struct picture *pic, enum blur_border border);
+  void naive_blur_picture(struct picture *pic);
+  void blur_picture_radius(struct picture *pic, int radius);
+  void gaussian_blur_picture(struct picture *pic, double sigma);
   void parallel_blur_picture(struct picture *pic);
+  void parallel_blur_picture_border(struct picture *pic, enum blur_border border);
+  void parallel_tile_blur_picture(struct picture *pic);
+  void parallel_pixel_blur_picture(struct picture *pic);
   void parallel_row_blur_picture(struct picture *pic);
   void parallel_column_blur_picture(struct picture *pic);
   void parallel_v_half_sector_blur_picture(struct picture *pic);
   void parallel_h_half_sector_blur_picture(struct picture *pic);
   void parallel_quarter_sector_blur_picture(struct picture *pic);
 
+  // runs a chain of transformations, fusing the point operations and blurs
+  void run_picture_pipeline(struct picture *pic, const struct pipeline_op *ops, int num_ops);
+
 #endif
 
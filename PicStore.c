@@ -1,21 +1,772 @@
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/stat.h>
 #include "PicStore.h"
 
-void init_picstore(struct pic_store *pstore){
- //TODO: implement this function for the Optional Extension
-}    
+  // slots of the smallest index
+  #define MIN_INDEX_CAPACITY 8
+  // longest path of a spilled picture's file
+  #define MAX_SPILL_PATH 4096
 
-void print_picstore(struct pic_store *pstore){
- //TODO: implement this function for the Optional Extension   
-}
+  // A thread reading the indexes of the stores. Its state is the epoch its
+  // outermost read began in, shifted left by one, with the low bit set while
+  // the read lasts. Readers are never freed, but are reused once their
+  // thread exits.
+  struct epoch_reader {
+    atomic_long state;
+    atomic_bool in_use;
+    // reads the thread has nested
+    int depth;
+    struct epoch_reader *next;
+  };
 
-void load_picture(struct pic_store *pstore, const char *path, const char *filename){
- //TODO: implement this function for the Optional Extension    
-}
+  // Epoch shared by the readers of every store. It only moves on once every
+  // thread in a read has seen it, so anything replaced two epochs ago can no
+  // longer be reached by any reader.
+  static atomic_long global_epoch = 0;
+  static _Atomic(struct epoch_reader *) epoch_readers = NULL;
+  static pthread_key_t epoch_reader_key;
+  static pthread_once_t epoch_reader_once = PTHREAD_ONCE_INIT;
+  static _Thread_local struct epoch_reader *current_reader = NULL;
 
-void unload_picture(struct pic_store *pstore, const char *filename){
- //TODO: implement this function for the Optional Extension   
-}
+  static void put_epoch_reader(void *vreader){
+    struct epoch_reader *reader = (struct epoch_reader *) vreader;
+    reader->depth = 0;
+    atomic_store(&reader->state, 0);
+    atomic_store(&reader->in_use, false);
+  }
 
-void save_picture(struct pic_store *pstore, const char *filename, const char *path){
- //TODO: implement this function for the Optional Extension    
-}
+  static void init_epoch_readers(void){
+    pthread_key_create(&epoch_reader_key, put_epoch_reader);
+  }
+
+  // the calling thread's reader, claiming a free one or adding one on first use
+  static struct epoch_reader *get_epoch_reader(void){
+    if(current_reader != NULL){
+      return current_reader;
+    }
+    pthread_once(&epoch_reader_once, init_epoch_readers);
+    struct epoch_reader *reader = atomic_load(&epoch_readers);
+    while(reader != NULL){
+      bool in_use = false;
+      if(atomic_compare_exchange_strong(&reader->in_use, &in_use, true)){
+        break;
+      }
+      reader = reader->next;
+    }
+    if(reader == NULL){
+      reader = malloc(sizeof(struct epoch_reader));
+      atomic_init(&reader->state, 0);
+      atomic_init(&reader->in_use, true);
+      reader->depth = 0;
+      reader->next = atomic_load(&epoch_readers);
+      while(!atomic_compare_exchange_weak(&epoch_readers, &reader->next, reader)){
+      }
+    }
+    pthread_setspecific(epoch_reader_key, reader);
+    current_reader = reader;
+    return reader;
+  }
+
+  // Brackets a read of an index and the entries it leads to, none of which
+  // are released until the read ends. Reads may nest.
+  static void begin_read(void){
+    struct epoch_reader *reader = get_epoch_reader();
+    if(reader->depth++ == 0){
+      atomic_store(&reader->state, (atomic_load(&global_epoch) << 1) | 1);
+      // the state must be visible before the read loads any index
+      atomic_thread_fence(memory_order_seq_cst);
+    }
+  }
+
+  static void end_read(void){
+    struct epoch_reader *reader = current_reader;
+    if(--reader->depth == 0){
+      atomic_store_explicit(&reader->state, 0, memory_order_release);
+    }
+  }
+
+  // moves the epoch on if every thread in a read has seen it; returns the epoch
+  static long advance_epoch(void){
+    long epoch = atomic_load(&global_epoch);
+    for(struct epoch_reader *reader = atomic_load(&epoch_readers); reader != NULL; reader = reader->next){
+      long state = atomic_load(&reader->state);
+      if((state & 1) && (state >> 1) != epoch){
+        return epoch;
+      }
+    }
+    if(atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1)){
+      return epoch + 1;
+    }
+    return epoch;
+  }
+
+  // FNV-1a hash of a picture name
+  static unsigned long hash_name(const char *name){
+    unsigned long hash = 14695981039346656037UL;
+    for(const unsigned char *c = (const unsigned char *) name; *c != '\0'; c++){
+      hash = (hash ^ *c) * 1099511628211UL;
+    }
+    return hash;
+  }
+
+  static struct pic_index *new_index(int size){
+    int capacity = MIN_INDEX_CAPACITY;
+    while(capacity < 2 * size){
+      capacity *= 2;
+    }
+    struct pic_index *index = calloc(1, sizeof(struct pic_index) + capacity * sizeof(struct pic_entry *));
+    if(index != NULL){
+      index->capacity = capacity;
+    }
+    return index;
+  }
+
+  // slot holding the named entry, or the empty slot it would go in
+  static struct pic_entry **index_slot(struct pic_index *index, const char *filename){
+    int mask = index->capacity - 1;
+    int slot = hash_name(filename) & mask;
+    while(index->slots[slot] != NULL && strcmp(index->slots[slot]->name, filename) != 0){
+      slot = (slot + 1) & mask;
+    }
+    return &index->slots[slot];
+  }
+
+  // copy of the index with added put in, or removed left out (NULL on failure)
+  static struct pic_index *rebuild_index(struct pic_index *index, struct pic_entry *added, struct pic_entry *removed){
+    struct pic_index *rebuilt = new_index(index->size + (added != NULL ? 1 : 0));
+    if(rebuilt == NULL){
+      return NULL;
+    }
+    for(int i = 0; i < index->capacity; i++){
+      struct pic_entry *entry = index->slots[i];
+      if(entry != NULL && entry != removed){
+        *index_slot(rebuilt, entry->name) = entry;
+        rebuilt->size++;
+      }
+    }
+    if(added != NULL){
+      *index_slot(rebuilt, added->name) = added;
+      rebuilt->size++;
+    }
+    return rebuilt;
+  }
+
+  // bytes of pixels the entry holds while resident
+  static long entry_bytes(struct pic_entry *entry){
+    return (long) entry->pic.width * entry->pic.height * COMPACT_PIXEL_SIZE;
+  }
+
+  static void spill_path(struct pic_entry *entry, char *path){
+    snprintf(path, MAX_SPILL_PATH, "%s/%ld.raw", entry->store->spill_dir, entry->id);
+  }
+
+  static long source_bytes(struct pic_source *source){
+    return (long) source->width * source->height * COMPACT_PIXEL_SIZE;
+  }
+
+  static bool same_time(struct timespec a, struct timespec b){
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+  }
+
+  // counts the source's pixels as resident while a picture still in the
+  // store shares them (the caller holds the sources lock)
+  static void count_source(struct pic_store *pstore, struct pic_source *source){
+    bool counted = source->pixels != NULL && source->refs > source->unloaded;
+    if(counted != source->counted){
+      atomic_fetch_add(&pstore->resident_bytes, counted ? source_bytes(source) : -source_bytes(source));
+      source->counted = counted;
+    }
+  }
+
+  // drops a picture's share of the source (unloaded if the picture has
+  // been), freeing it with the last one
+  static void release_source(struct pic_store *pstore, struct pic_source *source, bool unloaded){
+    pthread_mutex_lock(&pstore->sources_lock);
+    source->refs--;
+    source->unloaded -= unloaded;
+    count_source(pstore, source);
+    bool last = source->refs == 0;
+    if(last){
+      struct pic_source **link = &pstore->sources;
+      while(*link != source){
+        link = &(*link)->next;
+      }
+      *link = source->next;
+    }
+    pthread_mutex_unlock(&pstore->sources_lock);
+
+    if(last){
+      if(source->pixels != NULL){
+        free_pixels(source->pixels);
+      }
+      free(source->path);
+      free(source);
+    }
+  }
+
+  // Shares the pixels decoded from the current version of the file at path,
+  // decoding them if no other picture has (NULL if they cannot be). Loads of
+  // a file being decoded wait for it rather than decoding it again.
+  static struct pic_source *acquire_source(struct pic_store *pstore, const char *path){
+    struct stat info;
+    char *canonical = stat(path, &info) == 0 ? realpath(path, NULL) : NULL;
+    if(canonical == NULL){
+      return NULL;
+    }
+
+    pthread_mutex_lock(&pstore->sources_lock);
+    struct pic_source *source = pstore->sources;
+    while(source != NULL && (strcmp(source->path, canonical) != 0 || !same_time(source->mtime, info.st_mtim))){
+      source = source->next;
+    }
+    if(source != NULL){
+      free(canonical);
+      source->refs++;
+      count_source(pstore, source);
+      while(!source->ready){
+        pthread_cond_wait(&pstore->sources_ready, &pstore->sources_lock);
+      }
+      pthread_mutex_unlock(&pstore->sources_lock);
+      if(source->pixels == NULL){
+        release_source(pstore, source, false);
+        return NULL;
+      }
+      atomic_fetch_add(&pstore->shared_loads, 1);
+      return source;
+    }
+
+    source = malloc(sizeof(struct pic_source));
+    if(source == NULL){
+      pthread_mutex_unlock(&pstore->sources_lock);
+      free(canonical);
+      return NULL;
+    }
+    source->path = canonical;
+    source->mtime = info.st_mtim;
+    source->pixels = NULL;
+    source->refs = 1;
+    source->unloaded = 0;
+    source->counted = false;
+    source->ready = false;
+    source->next = pstore->sources;
+    pstore->sources = source;
+    pthread_mutex_unlock(&pstore->sources_lock);
+
+    // decode without holding the lock, so loads of other files carry on
+    struct picture pic;
+    bool decoded = init_compact_picture_from_file(&pic, path);
+    if(decoded && !is_compact_picture(&pic)){
+      clear_picture(&pic);
+      decoded = false;
+    }
+    atomic_fetch_add(&pstore->decodes, 1);
+
+    pthread_mutex_lock(&pstore->sources_lock);
+    if(decoded){
+      source->pixels = pic.pixels;
+      source->width = pic.width;
+      source->height = pic.height;
+    }
+    source->ready = true;
+    count_source(pstore, source);
+    pthread_cond_broadcast(&pstore->sources_ready);
+    pthread_mutex_unlock(&pstore->sources_lock);
+
+    if(!decoded){
+      release_source(pstore, source, false);
+      return NULL;
+    }
+    return source;
+  }
+
+  // gives the picture pixels of its own in place of shared ones (the caller
+  // holds the entry's write lock)
+  static bool unshare_entry(struct pic_entry *entry){
+    struct pic_source *source = entry->source;
+    long bytes = source_bytes(source);
+    uint8_t *pixels = malloc(bytes);
+    if(pixels == NULL){
+      return false;
+    }
+    memcpy(pixels, source->pixels, bytes);
+    pthread_mutex_lock(&entry->reload_lock);
+    entry->pic.pixels = pixels;
+    entry->source = NULL;
+    if(!entry->unloaded){
+      atomic_fetch_add(&entry->store->resident_bytes, bytes);
+    }
+    release_source(entry->store, source, entry->unloaded);
+    pthread_mutex_unlock(&entry->reload_lock);
+    return true;
+  }
+
+  // Stops counting the pixels of an unloaded picture as resident, although
+  // the commands still holding it keep them until they release it.
+  static void mark_unloaded(struct pic_entry *entry){
+    struct pic_store *pstore = entry->store;
+    pthread_mutex_lock(&entry->reload_lock);
+    entry->unloaded = true;
+    if(entry->source != NULL){
+      pthread_mutex_lock(&pstore->sources_lock);
+      entry->source->unloaded++;
+      count_source(pstore, entry->source);
+      pthread_mutex_unlock(&pstore->sources_lock);
+    }
+    else if(!atomic_load(&entry->spilled)){
+      atomic_fetch_sub(&pstore->resident_bytes, entry_bytes(entry));
+    }
+    pthread_mutex_unlock(&entry->reload_lock);
+  }
+
+  static void free_entry(struct pic_entry *entry){
+    if(entry->source != NULL){
+      // the pixels belong to the source
+      entry->pic.pixels = NULL;
+      release_source(entry->store, entry->source, entry->unloaded);
+    }
+    else if(atomic_load(&entry->spilled)){
+      char path[MAX_SPILL_PATH];
+      spill_path(entry, path);
+      unlink(path);
+    }
+    else if(!entry->unloaded){
+      atomic_fetch_sub(&entry->store->resident_bytes, entry_bytes(entry));
+    }
+    clear_picture(&entry->pic);
+    pthread_mutex_destroy(&entry->reload_lock);
+    pthread_rwlock_destroy(&entry->lock);
+    free(entry->name);
+    free(entry);
+  }
+
+  static void drop_entry_ref(void *ventry){
+    struct pic_entry *entry = (struct pic_entry *) ventry;
+    if(atomic_fetch_sub(&entry->refs, 1) == 1){
+      free_entry(entry);
+    }
+  }
+
+  // Releases the retired items no reader can reach any more (the caller
+  // holds the writer lock).
+  static void reclaim(struct pic_store *pstore){
+    // a second advance, if every reader has seen the first, lets go of what
+    // was retired in the current epoch too
+    advance_epoch();
+    long epoch = advance_epoch();
+    struct pic_retired **link = &pstore->retired;
+    while(*link != NULL){
+      struct pic_retired *retired = *link;
+      if(retired->epoch + 2 <= epoch){
+        *link = retired->next;
+        atomic_fetch_sub(&pstore->num_retired, 1);
+        retired->release(retired->item);
+        free(retired);
+      }
+      else{
+        link = &retired->next;
+      }
+    }
+  }
+
+  // Reclaims whatever retired items are waiting, unless a load or unload
+  // holds the writer lock (which then reclaims them itself).
+  static void try_reclaim(struct pic_store *pstore){
+    if(atomic_load(&pstore->num_retired) == 0 || pthread_mutex_trylock(&pstore->writer_lock) != 0){
+      return;
+    }
+    reclaim(pstore);
+    pthread_mutex_unlock(&pstore->writer_lock);
+  }
+
+  // ends a read of the store, reclaiming what it may have been holding back
+  static void end_store_read(struct pic_store *pstore){
+    end_read();
+    try_reclaim(pstore);
+  }
+
+  // Hands over something a load or unload replaced, to be released once no
+  // reader can reach it, and releases whatever has got there meanwhile (the
+  // caller holds the writer lock).
+  static void retire(struct pic_store *pstore, void *item, void (* release)(void *item)){
+    struct pic_retired *retired = malloc(sizeof(struct pic_retired));
+    if(retired == NULL){
+      // with nowhere to keep it, wait for the readers that may reach it instead
+      long epoch = atomic_load(&global_epoch);
+      while(advance_epoch() < epoch + 2){
+        sched_yield();
+      }
+      release(item);
+      return;
+    }
+    retired->item = item;
+    retired->release = release;
+    retired->epoch = atomic_load(&global_epoch);
+    retired->next = pstore->retired;
+    pstore->retired = retired;
+    atomic_fetch_add(&pstore->num_retired, 1);
+    reclaim(pstore);
+  }
+
+  static int compare_names(const void *a, const void *b){
+    return strcmp(*(char * const *) a, *(char * const *) b);
+  }
+
+  static int compare_last_used(const void *a, const void *b){
+    long used_a = atomic_load(&(*(struct pic_entry * const *) a)->last_used);
+    long used_b = atomic_load(&(*(struct pic_entry * const *) b)->last_used);
+    return (used_a > used_b) - (used_a < used_b);
+  }
+
+  // Writes a compact picture's pixels to the spill directory as they are and
+  // frees them, or drops its share of them if they are shared: shared pixels
+  // leave memory once every picture sharing them has been spilled or
+  // unloaded (the caller holds the entry's write lock and the spill lock).
+  static bool spill_entry(struct pic_store *pstore, struct pic_entry *entry){
+    if(!is_compact_picture(&entry->pic)){
+      return false;
+    }
+    // unloaded pictures no longer count against the budget
+    pthread_mutex_lock(&entry->reload_lock);
+    bool unloaded = entry->unloaded;
+    pthread_mutex_unlock(&entry->reload_lock);
+    if(unloaded){
+      return false;
+    }
+    if(pstore->spill_dir == NULL){
+      const char *tmp_dir = getenv("TMPDIR");
+      char template[MAX_SPILL_PATH];
+      snprintf(template, sizeof(template), "%s/picstore-XXXXXX", tmp_dir != NULL ? tmp_dir : "/tmp");
+      if(mkdtemp(template) == NULL){
+        return false;
+      }
+      pstore->spill_dir = strdup(template);
+    }
+
+    char path[MAX_SPILL_PATH];
+    spill_path(entry, path);
+    FILE *file = fopen(path, "wb");
+    if(file == NULL){
+      return false;
+    }
+    long bytes = entry_bytes(entry);
+    bool written = fwrite(entry->pic.pixels, 1, bytes, file) == (size_t) bytes;
+    if(fclose(file) != 0 || !written){
+      unlink(path);
+      return false;
+    }
+    pthread_mutex_lock(&entry->reload_lock);
+    if(entry->source != NULL){
+      // the picture gets pixels of its own when it is reloaded
+      release_source(pstore, entry->source, entry->unloaded);
+      entry->source = NULL;
+    }
+    else{
+      free_pixels(entry->pic.pixels);
+      if(!entry->unloaded){
+        atomic_fetch_sub(&pstore->resident_bytes, bytes);
+      }
+    }
+    entry->pic.pixels = NULL;
+    atomic_store(&entry->spilled, true);
+    pthread_mutex_unlock(&entry->reload_lock);
+    atomic_fetch_add(&pstore->spills, 1);
+    return true;
+  }
+
+  // Reads a spilled picture's pixels back, unless another command reading
+  // it got there first (the caller holds the entry's lock).
+  static bool reload_entry(struct pic_entry *entry){
+    bool reloaded = true;
+    pthread_mutex_lock(&entry->reload_lock);
+    if(atomic_load(&entry->spilled)){
+      char path[MAX_SPILL_PATH];
+      spill_path(entry, path);
+      long bytes = entry_bytes(entry);
+      uint8_t *pixels = malloc(bytes);
+      FILE *file = fopen(path, "rb");
+      reloaded = pixels != NULL && file != NULL && fread(pixels, 1, bytes, file) == (size_t) bytes;
+      if(file != NULL){
+        fclose(file);
+      }
+      if(reloaded){
+        unlink(path);
+        entry->pic.pixels = pixels;
+        if(!entry->unloaded){
+          atomic_fetch_add(&entry->store->resident_bytes, bytes);
+        }
+        atomic_store(&entry->spilled, false);
+      }
+      else{
+        free(pixels);
+      }
+    }
+    pthread_mutex_unlock(&entry->reload_lock);
+    return reloaded;
+  }
+
+  // Spills the least recently used pictures not in use until the store is
+  // back under budget. Only one thread spills at a time; the others carry on.
+  static void enforce_budget(struct pic_store *pstore){
+    // unloaded pictures no reader can reach any more are freed first
+    try_reclaim(pstore);
+    if(pstore->budget == 0 || atomic_load(&pstore->resident_bytes) <= pstore->budget){
+      return;
+    }
+    if(pthread_mutex_trylock(&pstore->spill_lock) != 0){
+      return;
+    }
+    begin_read();
+    struct pic_index *index = atomic_load(&pstore->index);
+    struct pic_entry **entries = malloc((index->size + 1) * sizeof(struct pic_entry *));
+    int count = 0;
+    for(int i = 0; entries != NULL && i < index->capacity; i++){
+      if(index->slots[i] != NULL && !atomic_load(&index->slots[i]->spilled)){
+        entries[count++] = index->slots[i];
+      }
+    }
+    qsort(entries, count, sizeof(struct pic_entry *), compare_last_used);
+
+    for(int i = 0; i < count && atomic_load(&pstore->resident_bytes) > pstore->budget; i++){
+      // pictures in use are skipped rather than waited for
+      if(pthread_rwlock_trywrlock(&entries[i]->lock) == 0){
+        if(!atomic_load(&entries[i]->spilled)){
+          spill_entry(pstore, entries[i]);
+        }
+        pthread_rwlock_unlock(&entries[i]->lock);
+      }
+    }
+    end_store_read(pstore);
+    free(entries);
+    pthread_mutex_unlock(&pstore->spill_lock);
+  }
+
+  void init_picstore(struct pic_store *pstore, long budget){
+    atomic_init(&pstore->index, new_index(0));
+    pthread_mutex_init(&pstore->writer_lock, NULL);
+    pstore->retired = NULL;
+    pstore->next_id = 0;
+    atomic_init(&pstore->num_retired, 0);
+    pstore->budget = budget;
+    atomic_init(&pstore->resident_bytes, 0);
+    pthread_mutex_init(&pstore->spill_lock, NULL);
+    pstore->spill_dir = NULL;
+    atomic_init(&pstore->clock, 0);
+    atomic_init(&pstore->hits, 0);
+    atomic_init(&pstore->misses, 0);
+    atomic_init(&pstore->spills, 0);
+    pstore->sources = NULL;
+    pthread_mutex_init(&pstore->sources_lock, NULL);
+    pthread_cond_init(&pstore->sources_ready, NULL);
+    atomic_init(&pstore->decodes, 0);
+    atomic_init(&pstore->shared_loads, 0);
+  }
+
+  void clear_picstore(struct pic_store *pstore){
+    struct pic_index *index = atomic_load(&pstore->index);
+    for(int i = 0; i < index->capacity; i++){
+      if(index->slots[i] != NULL){
+        drop_entry_ref(index->slots[i]);
+      }
+    }
+    free(index);
+    while(pstore->retired != NULL){
+      struct pic_retired *retired = pstore->retired;
+      pstore->retired = retired->next;
+      retired->release(retired->item);
+      free(retired);
+    }
+    if(pstore->spill_dir != NULL){
+      rmdir(pstore->spill_dir);
+      free(pstore->spill_dir);
+    }
+    pthread_cond_destroy(&pstore->sources_ready);
+    pthread_mutex_destroy(&pstore->sources_lock);
+    pthread_mutex_destroy(&pstore->spill_lock);
+    pthread_mutex_destroy(&pstore->writer_lock);
+  }
+
+  void print_picstore(struct pic_store *pstore){
+    // the names stay valid until the read ends, so only need sorting
+    begin_read();
+    struct pic_index *index = atomic_load(&pstore->index);
+    const char **names = malloc((index->size + 1) * sizeof(char *));
+    if(names == NULL){
+      end_store_read(pstore);
+      printf("[!] unable to list the picture store\n");
+      return;
+    }
+    int count = 0;
+    int spilled = 0;
+    for(int i = 0; i < index->capacity; i++){
+      if(index->slots[i] != NULL){
+        names[count++] = index->slots[i]->name;
+        spilled += atomic_load(&index->slots[i]->spilled);
+      }
+    }
+    qsort(names, count, sizeof(char *), compare_names);
+    for(int i = 0; i < count; i++){
+      printf("%s\n", names[i]);
+    }
+    printf("(%d resident, %d spilled)\n", count - spilled, spilled);
+    end_store_read(pstore);
+    free(names);
+  }
+
+  void print_picstore_stats(struct pic_store *pstore){
+    printf("{\"budget\": %ld, \"resident_bytes\": %ld, \"hits\": %ld, \"misses\": %ld, \"spills\": %ld, "
+           "\"decodes\": %ld, \"shared_loads\": %ld}\n",
+           pstore->budget, atomic_load(&pstore->resident_bytes), atomic_load(&pstore->hits),
+           atomic_load(&pstore->misses), atomic_load(&pstore->spills), atomic_load(&pstore->decodes),
+           atomic_load(&pstore->shared_loads));
+  }
+
+  int visit_picstore(struct pic_store *pstore, void (* visit)(const char *name, void *ctx), void *ctx){
+    begin_read();
+    struct pic_index *index = atomic_load(&pstore->index);
+    for(int i = 0; i < index->capacity; i++){
+      if(index->slots[i] != NULL){
+        visit(index->slots[i]->name, ctx);
+      }
+    }
+    int count = index->size;
+    end_store_read(pstore);
+    return count;
+  }
+
+  bool load_picture(struct pic_store *pstore, const char *path, const char *filename){
+    struct pic_entry *entry = malloc(sizeof(struct pic_entry));
+    if(entry == NULL){
+      printf("[!] unable to load %s\n", path);
+      return false;
+    }
+    entry->name = strdup(filename);
+    // decode (or share) before taking the writer lock, so loads run alongside everything else
+    entry->source = entry->name != NULL ? acquire_source(pstore, path) : NULL;
+    if(entry->source == NULL){
+      printf("[!] unable to load %s\n", path);
+      free(entry->name);
+      free(entry);
+      return false;
+    }
+    init_compact_picture_from_pixels(&entry->pic, entry->source->pixels, entry->source->width, entry->source->height);
+    pthread_rwlock_init(&entry->lock, NULL);
+    atomic_init(&entry->refs, 1);
+    entry->store = pstore;
+    atomic_init(&entry->spilled, false);
+    entry->unloaded = false;
+    pthread_mutex_init(&entry->reload_lock, NULL);
+    atomic_init(&entry->last_used, atomic_fetch_add(&pstore->clock, 1));
+
+    pthread_mutex_lock(&pstore->writer_lock);
+    entry->id = pstore->next_id++;
+    struct pic_index *index = atomic_load(&pstore->index);
+    bool taken = *index_slot(index, filename) != NULL;
+    struct pic_index *rebuilt = taken ? NULL : rebuild_index(index, entry, NULL);
+    if(rebuilt != NULL){
+      atomic_store(&pstore->index, rebuilt);
+      retire(pstore, index, free);
+    }
+    pthread_mutex_unlock(&pstore->writer_lock);
+
+    if(rebuilt == NULL){
+      if(taken){
+        printf("[!] a picture named %s is already loaded\n", filename);
+      }
+      else{
+        printf("[!] unable to load %s\n", path);
+      }
+      free_entry(entry);
+      return false;
+    }
+    enforce_budget(pstore);
+    return true;
+  }
+
+  bool unload_picture(struct pic_store *pstore, const char *filename){
+    pthread_mutex_lock(&pstore->writer_lock);
+    struct pic_index *index = atomic_load(&pstore->index);
+    struct pic_entry *entry = *index_slot(index, filename);
+    struct pic_index *rebuilt = entry != NULL ? rebuild_index(index, NULL, entry) : NULL;
+    if(rebuilt != NULL){
+      atomic_store(&pstore->index, rebuilt);
+      mark_unloaded(entry);
+      retire(pstore, index, free);
+      // commands still holding the entry keep it alive until they release it
+      retire(pstore, entry, drop_entry_ref);
+    }
+    pthread_mutex_unlock(&pstore->writer_lock);
+
+    if(entry == NULL){
+      printf("[!] no picture named %s is loaded\n", filename);
+      return false;
+    }
+    if(rebuilt == NULL){
+      printf("[!] unable to unload %s\n", filename);
+      return false;
+    }
+    return true;
+  }
+
+  bool save_picture(struct pic_store *pstore, const char *filename, const char *path){
+    struct pic_entry *entry = acquire_picture(pstore, filename, false);
+    if(entry == NULL){
+      printf("[!] no picture named %s is loaded\n", filename);
+      return false;
+    }
+    bool saved = save_picture_to_file(&entry->pic, path);
+    release_picture(entry);
+    if(!saved){
+      printf("[!] unable to save %s to %s\n", filename, path);
+    }
+    return saved;
+  }
+
+  struct pic_entry *acquire_picture(struct pic_store *pstore, const char *filename, bool write){
+    // the store's reference outlives the read, so the entry can be taken
+    // without any lock
+    begin_read();
+    struct pic_entry *entry = *index_slot(atomic_load(&pstore->index), filename);
+    if(entry != NULL){
+      atomic_fetch_add(&entry->refs, 1);
+    }
+    end_store_read(pstore);
+
+    if(entry == NULL){
+      return NULL;
+    }
+    if(write){
+      pthread_rwlock_wrlock(&entry->lock);
+    }
+    else{
+      pthread_rwlock_rdlock(&entry->lock);
+    }
+
+    // pictures are only spilled under the write lock, so stay resident once reloaded
+    atomic_store(&entry->last_used, atomic_fetch_add(&pstore->clock, 1));
+    if(!atomic_load(&entry->spilled)){
+      atomic_fetch_add(&pstore->hits, 1);
+    }
+    else{
+      atomic_fetch_add(&pstore->misses, 1);
+      if(!reload_entry(entry)){
+        printf("[!] unable to reload %s from the spill directory\n", filename);
+        release_picture(entry);
+        return NULL;
+      }
+    }
+    // a picture about to change stops sharing its pixels
+    if(write && entry->source != NULL && !unshare_entry(entry)){
+      printf("[!] unable to copy the pixels of %s\n", filename);
+      release_picture(entry);
+      return NULL;
+    }
+    enforce_budget(pstore);
+    return entry;
+  }
+
+  void release_picture(struct pic_entry *entry){
+    pthread_rwlock_unlock(&entry->lock);
+    drop_entry_ref(entry);
+  }
@@ -1,21 +1,135 @@
 #ifndef PICSTORE_H
 #define PICSTORE_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "Picture.h"
 #include "Utils.h"
 
-struct pic_store {
-  // TODO: implement this struct with a picture container for the Optional Extension
-};
+  // Compact pixels decoded from one version of a picture file, shared by
+  // every picture loaded from it until that picture is first changed or
+  // spilled.
+  struct pic_source {
+    // canonical path of the file, and its modification time when decoded
+    char *path;
+    struct timespec mtime;
+    uint8_t *pixels;
+    int width;
+    int height;
+    // pictures sharing the pixels, and loads waiting for them
+    int refs;
+    // those of the pictures that have been unloaded, and whether the pixels
+    // count as resident (only while a picture still in the store shares them)
+    int unloaded;
+    bool counted;
+    // whether decoding has finished (with no pixels if it failed)
+    bool ready;
+    struct pic_source *next;
+  };
 
-// picture library initialisation 
-void init_picstore(struct pic_store *pstore);
+  // A named picture held by the store. Its picture is kept compact between
+  // commands, and guarded by lock: read for commands that only look at it
+  // (save), write for the ones that change it or spill it to disk.
+  struct pic_entry {
+    char *name;
+    struct picture pic;
+    pthread_rwlock_t lock;
+    // references held by the store and by the commands that acquired the entry
+    atomic_int refs;
+    struct pic_store *store;
+    // number of the entry's file in the store's spill directory
+    long id;
+    // pixels pic shares with the other pictures loaded from the same file
+    // (NULL once the picture has pixels of its own, or has been spilled)
+    struct pic_source *source;
+    // whether the pixels are on disk rather than in pic (no data then)
+    atomic_bool spilled;
+    // whether the entry has been unloaded, its pixels no longer counting as
+    // resident even while commands still hold it (guarded by reload_lock)
+    bool unloaded;
+    // serialises reloading the pixels between commands reading the picture,
+    // and any change to whether the store counts them as resident
+    pthread_mutex_t reload_lock;
+    // tick of the store's clock at which the entry was last acquired
+    atomic_long last_used;
+  };
 
-// command-line interpreter routines
-void print_picstore(struct pic_store *pstore);
-void load_picture(struct pic_store *pstore, const char *path, const char *filename);
-void unload_picture(struct pic_store *pstore, const char *filename);
-void save_picture(struct pic_store *pstore, const char *filename, const char *path);
+  // Immutable hash index of the store's entries by name (open addressing,
+  // linear probing). Loads and unloads publish a new index rather than
+  // changing the current one, so readers never lock it.
+  struct pic_index {
+    // number of entries, and of slots (a power of two, at least twice size)
+    int size;
+    int capacity;
+    struct pic_entry *slots[];
+  };
 
-#endif
+  // Index or entry replaced by a load or unload, waiting for the readers
+  // that may still see it to move on before it is released.
+  struct pic_retired {
+    void *item;
+    void (* release)(void *item);
+    // reader epoch in which it was replaced
+    long epoch;
+    struct pic_retired *next;
+  };
+
+  struct pic_store {
+    _Atomic(struct pic_index *) index;
+    // serialises loads and unloads, and guards retired and next_id
+    pthread_mutex_t writer_lock;
+    struct pic_retired *retired;
+    long next_id;
+    // number of retired items, for readers to see whether any are waiting
+    atomic_int num_retired;
+    // bytes of pixels the resident pictures may hold (0 for no limit), and hold
+    long budget;
+    atomic_long resident_bytes;
+    // held by the thread spilling pictures to bring the store under budget
+    pthread_mutex_t spill_lock;
+    // directory the spilled pixels are written to (NULL until the first spill)
+    char *spill_dir;
+    atomic_long clock;
+    // pixels shared between loads of the same files, guarded by sources_lock,
+    // with sources_ready signalled when one of them has been decoded
+    struct pic_source *sources;
+    pthread_mutex_t sources_lock;
+    pthread_cond_t sources_ready;
+    // acquisitions that found the picture resident, or had to reload it
+    atomic_long hits;
+    atomic_long misses;
+    atomic_long spills;
+    // picture files decoded, and loads that shared pixels decoded before
+    atomic_long decodes;
+    atomic_long shared_loads;
+  };
+
+  // picture library initialisation and clean up (no other thread may use
+  // the store while it is cleared); past budget bytes of pixels, the least
+  // recently used pictures are spilled to disk until they are next acquired
+  void init_picstore(struct pic_store *pstore, long budget);
+  void clear_picstore(struct pic_store *pstore);
+
+  // command-line interpreter routines (reporting their errors, and returning false on one)
+  void print_picstore(struct pic_store *pstore);
+  bool load_picture(struct pic_store *pstore, const char *path, const char *filename);
+  bool unload_picture(struct pic_store *pstore, const char *filename);
+  bool save_picture(struct pic_store *pstore, const char *filename, const char *path);
 
+  // prints the store's budget, resident bytes and hit, miss, spill, decode
+  // and shared load counts as a line of JSON
+  void print_picstore_stats(struct pic_store *pstore);
+
+  // calls visit with the name of every picture in one snapshot of the store,
+  // in no particular order, without blocking or being blocked by other
+  // commands (a name is only valid during its call); returns the count
+  int visit_picstore(struct pic_store *pstore, void (* visit)(const char *name, void *ctx), void *ctx);
+
+  // finds the named picture and locks it for reading, or for writing if
+  // write is set (NULL if there is none); the picture stays valid, even if
+  // unloaded meanwhile, until the entry is handed to release_picture
+  struct pic_entry *acquire_picture(struct pic_store *pstore, const char *filename, bool write);
+  void release_picture(struct pic_entry *entry);
+
+#endif
@@ -1,7 +1,12 @@
+#include <string.h>
 #include "Picture.h"
 
   bool init_picture_from_file(struct picture *pic, const char *path){
     pic->img = load_image(path);
+    pic->pixels = NULL;
+    pic->back.data = NULL;
+    pic->double_buffered = false;
+    pic->scratch = NULL;
     // check for picture initialisation error
     if( pic->img.data == 0 ){
       return false;
@@ -13,6 +18,10 @@
 
   bool init_picture_from_size(struct picture *pic, int width, int height){
     pic->img = create_image(width, height);
+    pic->pixels = NULL;
+    pic->back.data = NULL;
+    pic->double_buffered = false;
+    pic->scratch = NULL;
     // check for picture initialisation error
     if ( pic->img.data == 0 ){
       return false;
@@ -22,16 +31,116 @@
     return true;
   }
 
+  bool init_picture_copy(struct picture *pic, struct picture *src){
+    pic->img.data = NULL;
+    pic->pixels = NULL;
+    pic->back.data = NULL;
+    pic->double_buffered = false;
+    pic->scratch = NULL;
+    pic->width = src->width;
+    pic->height = src->height;
+
+    if(is_compact_picture(src)){
+      long size = (long) src->width * src->height * COMPACT_PIXEL_SIZE;
+      pic->pixels = malloc(size);
+      if(pic->pixels == NULL){
+        return false;
+      }
+      memcpy(pic->pixels, src->pixels, size);
+      return true;
+    }
+    pic->img = copy_image(src->img);
+    return pic->img.data != NULL;
+  }
+
+  bool init_compact_picture_from_file(struct picture *pic, const char *path){
+    if(!init_picture_from_file(pic, path)){
+      return false;
+    }
+    compact_picture(pic);
+    return true;
+  }
+
+  void init_compact_picture_from_pixels(struct picture *pic, uint8_t *pixels, int width, int height){
+    pic->img.data = NULL;
+    pic->pixels = pixels;
+    pic->back.data = NULL;
+    pic->double_buffered = false;
+    pic->scratch = NULL;
+    pic->width = width;
+    pic->height = height;
+  }
+
   bool save_picture_to_file(struct picture *pic, const char *path){
+    // compact pixels are already in the form the encoder takes
+    if(is_compact_picture(pic)){
+      return save_pixels(pic->pixels, pic->width, pic->height, path);
+    }
     return save_image(pic->img, path);   
   }
 
+  bool is_compact_picture(struct picture *pic){
+    return pic->img.data == NULL && pic->pixels != NULL;
+  }
+
+  void compact_picture(struct picture *pic){
+    if(is_compact_picture(pic)){
+      return;
+    }
+    uint8_t *pixels = image_to_pixels(pic->img);
+    if(pixels == NULL){
+      return;
+    }
+    pic->pixels = pixels;
+    free_image(pic->img);
+    pic->img.data = NULL;
+    // a float back buffer would undo the saving
+    if(pic->back.data != NULL){
+      free_image(pic->back);
+      pic->back.data = NULL;
+    }
+  }
+
+  void expand_picture(struct picture *pic){
+    if(!is_compact_picture(pic)){
+      return;
+    }
+    pic->img = create_image(pic->width, pic->height);
+
+    // de-interleave the pixels into the colour planes
+    long plane_size = (long) pic->width * pic->height;
+    for(int c = 0; c < COMPACT_PIXEL_SIZE; c++){
+      float *plane = pic->img.data + c * plane_size;
+      const uint8_t *channel = pic->pixels + c;
+      for(long k = 0; k < plane_size; k++){
+        plane[k] = channel[k * COMPACT_PIXEL_SIZE] / MAX_PIXEL_INTENSITY;
+      }
+    }
+    free_pixels(pic->pixels);
+    pic->pixels = NULL;
+  }
+
+  uint8_t *compact_picture_row(struct picture *pic, int y){
+    return pic->pixels + (long) y * pic->width * COMPACT_PIXEL_SIZE;
+  }
+
   // enum mapping to support get/set pixel functions
   enum RGB {RED, GREEN, BLUE};
 
   struct pixel get_pixel(struct picture *pic, int x, int y){
     // Beware: pixels are stored in a (x,y) vector from the top left of the image.
     struct pixel pix;
+
+    if(is_compact_picture(pic)){
+      // clamp to the nearest pixel inside the picture, as SOD reads do
+      x = x < 0 ? 0 : (x >= pic->width ? pic->width - 1 : x);
+      y = y < 0 ? 0 : (y >= pic->height ? pic->height - 1 : y);
+      uint8_t *rgb = compact_picture_row(pic, y) + x * COMPACT_PIXEL_SIZE;
+      pix.red = rgb[RED];
+      pix.green = rgb[GREEN];
+      pix.blue = rgb[BLUE];
+      return pix;
+    }
     
     pix.red = get_pixel_value(pic->img, RED, x, y);
     pix.green = get_pixel_value(pic->img, GREEN, x, y);
@@ -42,15 +151,135 @@
 
   void set_pixel(struct picture *pic, int x, int y, struct pixel *rgb){
     // Beware: pixels are stored in a (x,y) vector from the top left of the image.
+    if(is_compact_picture(pic)){
+      // drop writes outside the picture, as SOD does
+      if(!contains_point(pic, x, y)){
+        return;
+      }
+      uint8_t *pixel = compact_picture_row(pic, y) + x * COMPACT_PIXEL_SIZE;
+      pixel[RED] = rgb->red;
+      pixel[GREEN] = rgb->green;
+      pixel[BLUE] = rgb->blue;
+      return;
+    }
     set_pixel_value(pic->img, RED, x, y, rgb->red);
     set_pixel_value(pic->img, GREEN, x, y, rgb->green);
     set_pixel_value(pic->img, BLUE, x, y, rgb->blue);
   }
 
+  void get_pixel_span(struct picture *pic, int x, int y, int n, struct pixel *rgb){
+    if(is_compact_picture(pic)){
+      const uint8_t *pixel = compact_picture_row(pic, y) + x * COMPACT_PIXEL_SIZE;
+      for(int k = 0; k < n; k++, pixel += COMPACT_PIXEL_SIZE){
+        rgb[k].red = pixel[RED];
+        rgb[k].green = pixel[GREEN];
+        rgb[k].blue = pixel[BLUE];
+      }
+      return;
+    }
+
+    // same scaling and truncation as get_pixel_value
+    const float *red = picture_row(pic, RED, y) + x;
+    const float *green = picture_row(pic, GREEN, y) + x;
+    const float *blue = picture_row(pic, BLUE, y) + x;
+    for(int k = 0; k < n; k++){
+      rgb[k].red = red[k] * MAX_PIXEL_INTENSITY;
+      rgb[k].green = green[k] * MAX_PIXEL_INTENSITY;
+      rgb[k].blue = blue[k] * MAX_PIXEL_INTENSITY;
+    }
+  }
+
+  void set_pixel_span(struct picture *pic, int x, int y, int n, const struct pixel *rgb){
+    if(is_compact_picture(pic)){
+      uint8_t *pixel = compact_picture_row(pic, y) + x * COMPACT_PIXEL_SIZE;
+      for(int k = 0; k < n; k++, pixel += COMPACT_PIXEL_SIZE){
+        pixel[RED] = rgb[k].red;
+        pixel[GREEN] = rgb[k].green;
+        pixel[BLUE] = rgb[k].blue;
+      }
+      return;
+    }
+
+    // same scaling as set_pixel_value
+    float *red = picture_row(pic, RED, y) + x;
+    float *green = picture_row(pic, GREEN, y) + x;
+    float *blue = picture_row(pic, BLUE, y) + x;
+    for(int k = 0; k < n; k++){
+      red[k] = rgb[k].red / MAX_PIXEL_INTENSITY;
+      green[k] = rgb[k].green / MAX_PIXEL_INTENSITY;
+      blue[k] = rgb[k].blue / MAX_PIXEL_INTENSITY;
+    }
+  }
+
+  float *picture_row(struct picture *pic, int channel, int y){
+    return pic->img.data + ((long) channel * pic->height + y) * pic->width;
+  }
+
   bool contains_point(struct picture *pic, int x, int y){
       return x >= 0 && x < pic->width && y >= 0 && y < pic->height;
   }
   
+  void set_picture_double_buffered(struct picture *pic, bool enabled){
+    pic->double_buffered = enabled;
+    if(!enabled && pic->back.data != NULL){
+      free_image(pic->back);
+      pic->back.data = NULL;
+    }
+    if(!enabled){
+      free(pic->scratch);
+      pic->scratch = NULL;
+    }
+  }
+
+  sod_img take_back_buffer(struct picture *pic, int width, int height){
+    sod_img img = pic->back;
+    if(img.data == NULL || (long) img.w * img.h != (long) width * height){
+      return create_image(width, height);
+    }
+    // reuse the buffer, e.g. with the width and height swapped by a rotation
+    pic->back.data = NULL;
+    img.w = width;
+    img.h = height;
+    return img;
+  }
+
+  void return_back_buffer(struct picture *pic, sod_img img){
+    if(img.data == NULL){
+      return;
+    }
+    if(!pic->double_buffered || pic->back.data != NULL || is_compact_picture(pic)){
+      free_image(img);
+      return;
+    }
+    pic->back = img;
+  }
+
+  int *take_scratch(struct picture *pic, long min_size, long *size){
+    int *scratch = pic->scratch;
+    pic->scratch = NULL;
+    if(scratch != NULL && pic->scratch_size >= min_size){
+      *size = pic->scratch_size;
+      return scratch;
+    }
+    free(scratch);
+    *size = min_size;
+    return malloc(min_size * sizeof(int));
+  }
+
+  void return_scratch(struct picture *pic, int *scratch, long size){
+    if(!pic->double_buffered || pic->scratch != NULL){
+      free(scratch);
+      return;
+    }
+    pic->scratch = scratch;
+    pic->scratch_size = size;
+  }
+
   void clear_picture(struct picture *pic){
+    set_picture_double_buffered(pic, false);
+    if(is_compact_picture(pic)){
+      free_pixels(pic->pixels);
+      return;
+    }
     free_image(pic->img); 
   }  
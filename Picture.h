@@ -14,11 +14,24 @@
   // The picture struct provides a wrapper for image manipulation 
   // via the SOD library (https://sod.pixlab.io/intro.html)
   struct picture {    
-    // sod representation of an image
+    // sod representation of an image (no data while the picture is compact)
     sod_img img;
+    // interleaved 8-bit RGB pixels, row by row, while the picture is compact
+    uint8_t *pixels;
+    // image replaced by the last transformation, kept for the next one to
+    // write into when the picture is double buffered (no data otherwise)
+    sod_img back;
+    bool double_buffered;
+    // ints the last transformation worked in, kept with the back buffer for
+    // the next one (NULL otherwise), and how many there are
+    int *scratch;
+    long scratch_size;
     int width;
     int height;
   };    
+
+  // number of bytes per pixel of a compact picture
+  #define COMPACT_PIXEL_SIZE 3
       
   // initialise picture struct with image from a provided file
   bool init_picture_from_file(struct picture *pic, const char *path);
@@ -26,6 +39,49 @@
   // initialise picture struct of the specified size 
   bool init_picture_from_size(struct picture *pic, int width, int height); 
 
+  // initialise picture struct as a copy of another picture (in the same storage
+  // mode, but not double buffered)
+  bool init_picture_copy(struct picture *pic, struct picture *src);
+
+  // initialise picture struct with image from a provided file, kept compact
+  bool init_compact_picture_from_file(struct picture *pic, const char *path);
+
+  // initialise picture struct around width x height compact pixels, which
+  // it takes over (clear_picture frees them)
+  void init_compact_picture_from_pixels(struct picture *pic, uint8_t *pixels, int width, int height);
+
+  // check if the picture is stored as compact 8-bit pixels rather than float planes
+  bool is_compact_picture(struct picture *pic);
+
+  // switch the picture to compact 8-bit pixels (4x smaller), or back to the
+  // float planes the transformations and SOD work on; both are lossless for
+  // pictures whose pixels were read or set as whole intensities
+  void compact_picture(struct picture *pic);
+  void expand_picture(struct picture *pic);
+
+  // first of the width interleaved RGB pixels of row y of a compact picture
+  uint8_t *compact_picture_row(struct picture *pic, int y);
+
+  // keep the image each transformation replaces as a back buffer for the
+  // next one to write into, rather than freeing it (disabling frees it)
+  void set_picture_double_buffered(struct picture *pic, bool enabled);
+
+  // image of the given size for a transformation to write the picture's new
+  // contents into: the back buffer if it holds as many pixels, else a new one
+  sod_img take_back_buffer(struct picture *pic, int width, int height);
+
+  // hand back the picture's replaced image, kept as the back buffer if the
+  // picture is double buffered and freed otherwise
+  void return_back_buffer(struct picture *pic, sod_img img);
+
+  // at least min_size ints for a transformation to work in: the picture's
+  // kept scratch if it holds as many, else new ones (their number in *size)
+  int *take_scratch(struct picture *pic, long min_size, long *size);
+
+  // hand back the size ints of scratch, kept with the back buffer if the
+  // picture is double buffered and freed otherwise
+  void return_scratch(struct picture *pic, int *scratch, long size);
+
   // save picture to specified file
   bool save_picture_to_file(struct picture *pic, const char *path);
 
@@ -35,6 +91,15 @@
   // set a single pixel in the image from a colour struct
   void set_pixel(struct picture *pic, int x, int y, struct pixel *rgb);
 
+  // extract / set the n pixels from (x,y) along row y as colour structs, as
+  // get_pixel / set_pixel would one at a time (the span must lie in the row)
+  void get_pixel_span(struct picture *pic, int x, int y, int n, struct pixel *rgb);
+  void set_pixel_span(struct picture *pic, int x, int y, int n, const struct pixel *rgb);
+
+  // first of the width intensities of one colour channel (0 = red, 1 = green,
+  // 2 = blue) in row y of a (non-compact) picture, as stored in the image
+  float *picture_row(struct picture *pic, int channel, int y);
+
   // check if coordinates are within bounds of the stored image
   bool contains_point(struct picture *pic, int x, int y);
   
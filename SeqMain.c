@@ -12,7 +12,9 @@
     "rotate",
     "flip",
     "blur",
-    "parallel-blur"
+    "parallel-blur",
+    "blur-radius",
+    "gaussian-blur"
   };
 
 // -------------- picture transformation function wrappers -------------- \\
@@ -39,14 +41,43 @@
     flip_picture(pic, plane);
   }
 
-  void blur_picture_wrapper(struct picture *pic, const char *unused){
+  // border mode named by a blur's extra argument (skip when there is none)
+  static enum blur_border parse_blur_border(const char *arg){
+    if(arg == NULL || *arg == '\0' || strcmp(arg, "skip") == 0){
+      return BLUR_BORDER_SKIP;
+    }
+    if(strcmp(arg, "replicate") == 0){
+      return BLUR_BORDER_REPLICATE;
+    }
+    if(strcmp(arg, "mirror") == 0){
+      return BLUR_BORDER_MIRROR;
+    }
+    printf("[!] blur is undefined for border %s (must be skip, replicate or mirror)\n", arg);
+    exit(IO_ERROR);
+  }
+
+  void blur_picture_wrapper(struct picture *pic, const char *extra_arg){
+    enum blur_border border = parse_blur_border(extra_arg);
     printf("calling blur\n");
-    blur_picture(pic);
+    blur_picture_border(pic, border);
   }
   
-  void parallel_blur_wrapper(struct picture *pic, const char *unused){
+  void parallel_blur_wrapper(struct picture *pic, const char *extra_arg){
+    enum blur_border border = parse_blur_border(extra_arg);
     printf("calling parallel blur\n");
-    parallel_blur_picture(pic);
+    parallel_blur_picture_border(pic, border);
+  }
+
+  void blur_radius_wrapper(struct picture *pic, const char *extra_arg){
+    int radius = atoi(extra_arg);
+    printf("calling blur radius (%i)\n", radius);
+    blur_picture_radius(pic, radius);
+  }
+
+  void gaussian_blur_wrapper(struct picture *pic, const char *extra_arg){
+    double sigma = atof(extra_arg);
+    printf("calling gaussian blur (%g)\n", sigma);
+    gaussian_blur_picture(pic, sigma);
   }
 
 // ------------------------------------------------------------------------ \\
@@ -58,12 +89,82 @@
     rotate_picture_wrapper,
     flip_picture_wrapper,
     blur_picture_wrapper,
-    parallel_blur_wrapper
+    parallel_blur_wrapper,
+    blur_radius_wrapper,
+    gaussian_blur_wrapper
   };
 
   // size of look-up table (for safe IO error reporting)
   static int no_of_cmds = sizeof(cmds) / sizeof(cmds[0]);
 
+  // pipeline operation for each picture transformation, for chained processes
+  static const enum pipeline_op_type cmd_ops[] = {
+    PIPELINE_INVERT,
+    PIPELINE_GRAYSCALE,
+    PIPELINE_ROTATE,
+    PIPELINE_FLIP,
+    PIPELINE_BLUR,
+    PIPELINE_BLUR,
+    PIPELINE_BLUR_RADIUS,
+    PIPELINE_GAUSSIAN_BLUR
+  };
+
+  // separates the transformations of a chained process, e.g. invert+grayscale+blur
+  #define CHAIN_SEPARATOR "+"
+  // separates a transformation in a chain from its own argument, e.g. rotate:90
+  #define CHAIN_ARG_SEPARATOR ':'
+
+  // looks up a picture transformation by name (no_of_cmds if there is none)
+  static int find_cmd(const char *name){
+    int cmd_no = 0;
+    while(cmd_no < no_of_cmds && strcmp(name, cmd_strings[cmd_no])){
+      cmd_no++;
+    }
+    return cmd_no;
+  }
+
+  // runs a chain of transformations through the fused pipeline executor; a
+  // transformation without an argument of its own takes the extra argument
+  static void run_chain(struct picture *pic, const char *process, const char *extra_arg){
+    char *chain = strdup(process);
+    int max_ops = 1;
+    for(const char *c = process; *c != '\0'; c++){
+      max_ops += *c == CHAIN_SEPARATOR[0];
+    }
+    struct pipeline_op *ops = malloc(max_ops * sizeof(struct pipeline_op));
+    int num_ops = 0;
+
+    char *saveptr;
+    for(char *name = strtok_r(chain, CHAIN_SEPARATOR, &saveptr); name != NULL;
+        name = strtok_r(NULL, CHAIN_SEPARATOR, &saveptr)){
+      const char *arg = extra_arg != NULL ? extra_arg : "";
+      char *separator = strchr(name, CHAIN_ARG_SEPARATOR);
+      if(separator != NULL){
+        *separator = '\0';
+        arg = separator + 1;
+      }
+
+      int cmd_no = find_cmd(name);
+      if(cmd_no == no_of_cmds){
+        printf("[!] invalid process requested: %s is not defined\n    aborting...\n", name);
+        exit(IO_ERROR);
+      }
+      struct pipeline_op op = { cmd_ops[cmd_no], atof(arg), arg[0], BLUR_BORDER_SKIP };
+      if(op.type == PIPELINE_BLUR){
+        op.border = parse_blur_border(arg);
+      }
+      ops[num_ops++] = op;
+    }
+
+    // the operations of the chain take turns writing into the same two images
+    printf("calling pipeline (%s)\n", process);
+    set_picture_double_buffered(pic, true);
+    run_picture_pipeline(pic, ops, num_ops);
+
+    free(ops);
+    free(chain);
+  }
+
 
 // ---------- MAIN PROGRAM ---------- \\
 
@@ -95,11 +196,17 @@
       exit(IO_ERROR);   
     }    
   
-    // identify the picture transformation to run
-    int cmd_no = 0;
-    while(cmd_no < no_of_cmds && strcmp(process, cmd_strings[cmd_no])){
-      cmd_no++;
+    // a chain of transformations runs as one fused pipeline
+    if(strstr(process, CHAIN_SEPARATOR) != NULL){
+      run_chain(&pic, process, extra_arg);
+      save_picture_to_file(&pic, target_file);
+      printf("-- picture processing complete --\n");
+      clear_picture(&pic);
+      return 0;
     }
+
+    // identify the picture transformation to run
+    int cmd_no = find_cmd(process);
   
     // IO error check
     if(cmd_no == no_of_cmds){
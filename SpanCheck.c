@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include "Utils.h"
+#include "Picture.h"
+
+  // checks that get_pixel_span reads, pixel for pixel, what get_pixel does
+  // for spans of every row starting at x (length n, clipped to the row)
+  static bool check_get_span(struct picture *pic, int x, int n, const char *mode){
+    struct pixel *span = malloc(pic->width * sizeof(struct pixel));
+    bool same = true;
+    if(x + n > pic->width){
+      n = pic->width - x;
+    }
+    for(int j = 0; j < pic->height && same; j++){
+      get_pixel_span(pic, x, j, n, span);
+      for(int i = 0; i < n && same; i++){
+        struct pixel pixel = get_pixel(pic, x + i, j);
+        if(pixel.red != span[i].red || pixel.green != span[i].green || pixel.blue != span[i].blue){
+          printf("[!] fail - %s get_pixel_span differs from get_pixel at cell (%i,%i)\n", mode, x + i, j);
+          same = false;
+        }
+      }
+    }
+    free(span);
+    return same;
+  }
+
+  // checks that writing inverted pixels with set_pixel_span leaves the same
+  // picture as writing them one at a time with set_pixel
+  static bool check_set_span(struct picture *pic, const char *mode){
+    struct picture by_span;
+    struct picture by_pixel;
+    if(!init_picture_copy(&by_span, pic) || !init_picture_copy(&by_pixel, pic)){
+      printf("[!] fail - unable to copy the %s picture\n", mode);
+      return false;
+    }
+
+    struct pixel *span = malloc(pic->width * sizeof(struct pixel));
+    for(int j = 0; j < pic->height; j++){
+      for(int i = 0; i < pic->width; i++){
+        struct pixel pixel = get_pixel(pic, i, j);
+        pixel.red = MAX_PIXEL_INTENSITY - pixel.red;
+        pixel.green = MAX_PIXEL_INTENSITY - pixel.green;
+        pixel.blue = MAX_PIXEL_INTENSITY - pixel.blue;
+        span[i] = pixel;
+        set_pixel(&by_pixel, i, j, &pixel);
+      }
+      set_pixel_span(&by_span, 0, j, pic->width, span);
+    }
+    free(span);
+
+    bool same = true;
+    for(int j = 0; j < pic->height && same; j++){
+      for(int i = 0; i < pic->width && same; i++){
+        struct pixel pixel1 = get_pixel(&by_span, i, j);
+        struct pixel pixel2 = get_pixel(&by_pixel, i, j);
+        if(pixel1.red != pixel2.red || pixel1.green != pixel2.green || pixel1.blue != pixel2.blue){
+          printf("[!] fail - %s set_pixel_span differs from set_pixel at cell (%i,%i)\n", mode, i, j);
+          same = false;
+        }
+      }
+    }
+    clear_picture(&by_span);
+    clear_picture(&by_pixel);
+    return same;
+  }
+
+  static bool check_picture(struct picture *pic, const char *mode){
+    // whole rows, spans inside rows, and single pixels at either end
+    return check_get_span(pic, 0, pic->width, mode)
+        && check_get_span(pic, pic->width / 3, pic->width / 3, mode)
+        && check_get_span(pic, 0, 1, mode)
+        && check_get_span(pic, pic->width - 1, 1, mode)
+        && check_set_span(pic, mode);
+  }
+
+  int main(int argc, char ** argv){
+
+    if(argc != 2){
+      printf("usage: ./picture_span_check <file_path>\n");
+      return 1;
+    }
+
+    const char * pic_filename = argv[1];
+    printf("check pixel spans of %s:\n", pic_filename);
+
+    // the same picture stored as float planes, and as compact 8-bit pixels
+    struct picture pic;
+    struct picture compact;
+    if(!init_picture_from_file(&pic, pic_filename) || !init_compact_picture_from_file(&compact, pic_filename)){
+      printf("[!] fail - unable to load %s\n", pic_filename);
+      return 1;
+    }
+
+    bool same = check_picture(&pic, "float") && check_picture(&compact, "compact");
+    clear_picture(&pic);
+    clear_picture(&compact);
+    if(!same){
+      return 1;
+    }
+
+    printf("success - pixel spans match single pixels!\n");
+    return 0;
+
+  }
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "Utils.h"
+#include "Picture.h"
+#include "PicProcess.h"
+#include "PicStore.h"
+
+#define PINNED_PICTURES 4
+#define STORM_THREADS 3
+#define LIST_THREADS 2
+#define STORM_ROUNDS 40
+#define STORM_NAMES 4
+#define MAX_NAME_LENGTH 32
+// bytes of pixels the store may keep in memory, so that pictures keep being
+// spilled and reloaded under the storm
+#define STRESS_BUDGET (2 * 1024 * 1024)
+
+static const char *pic_path = "test_images/test.jpg";
+static struct pic_store store;
+static atomic_bool storm_over = false;
+static atomic_bool failed = false;
+static atomic_long lists = 0;
+
+// names seen in one snapshot of the store
+struct snapshot {
+  char names[PINNED_PICTURES + STORM_THREADS + 1][MAX_NAME_LENGTH];
+  int count;
+  bool overflow;
+};
+
+static void fail(const char *message) {
+  printf("[!] %s\n", message);
+  atomic_store(&failed, true);
+}
+
+static void pinned_name(char *name, int i) {
+  sprintf(name, "pinned%d", i);
+}
+
+static void collect_name(const char *name, void *vsnapshot) {
+  struct snapshot *snapshot = (struct snapshot *) vsnapshot;
+  if (snapshot->count == PINNED_PICTURES + STORM_THREADS + 1) {
+    snapshot->overflow = true;
+    return;
+  }
+  strncpy(snapshot->names[snapshot->count], name, MAX_NAME_LENGTH - 1);
+  snapshot->names[snapshot->count][MAX_NAME_LENGTH - 1] = '\0';
+  snapshot->count++;
+}
+
+static bool snapshot_has(struct snapshot *snapshot, const char *name) {
+  int seen = 0;
+  for (int i = 0; i < snapshot->count; i++) {
+    seen += strcmp(snapshot->names[i], name) == 0;
+  }
+  if (seen > 1) {
+    fail("a snapshot listed a picture twice");
+  }
+  return seen == 1;
+}
+
+/* Loads, changes and unloads pictures of its own as fast as it can. */
+static void *storm(void *varg) {
+  long thread = (long) varg;
+  char name[MAX_NAME_LENGTH];
+  for (int round = 0; round < STORM_ROUNDS && !atomic_load(&failed); round++) {
+    sprintf(name, "storm%ld_%d", thread, round % STORM_NAMES);
+    if (!load_picture(&store, pic_path, name)) {
+      fail("storm load failed");
+      break;
+    }
+    struct pic_entry *entry = acquire_picture(&store, name, true);
+    if (entry == NULL) {
+      fail("a loaded picture was not found");
+      break;
+    }
+    invert_picture(&entry->pic);
+    release_picture(entry);
+    if (!unload_picture(&store, name)) {
+      fail("storm unload failed");
+      break;
+    }
+  }
+  return NULL;
+}
+
+/* Lists the store in a tight loop, checking every snapshot is consistent:
+   each name listed once, no more names than can be loaded at a time, and
+   the pinned pictures always there and readable. */
+static void *list(void *unused) {
+  char name[MAX_NAME_LENGTH];
+  while (!atomic_load(&storm_over) && !atomic_load(&failed)) {
+    struct snapshot snapshot = { .count = 0, .overflow = false };
+    int count = visit_picstore(&store, collect_name, &snapshot);
+    if (snapshot.overflow || count != snapshot.count) {
+      fail("a snapshot did not match its own size");
+    }
+    for (int i = 0; i < PINNED_PICTURES; i++) {
+      pinned_name(name, i);
+      if (!snapshot_has(&snapshot, name)) {
+        fail("a pinned picture was missing from a snapshot");
+      }
+    }
+    for (int i = 0; i < snapshot.count; i++) {
+      snapshot_has(&snapshot, snapshot.names[i]);
+    }
+
+    pinned_name(name, atomic_load(&lists) % PINNED_PICTURES);
+    struct pic_entry *entry = acquire_picture(&store, name, false);
+    if (entry == NULL || entry->pic.width <= 0) {
+      fail("a pinned picture could not be read");
+    }
+    if (entry != NULL) {
+      release_picture(entry);
+    }
+    atomic_fetch_add(&lists, 1);
+    // let the storm through on machines with fewer cores than threads
+    sched_yield();
+  }
+  return NULL;
+}
+
+// ---------- MAIN PROGRAM ---------- \\
+
+  int main(int argc, char **argv) {
+    pthread_t storm_threads[STORM_THREADS];
+    pthread_t list_threads[LIST_THREADS];
+    char name[MAX_NAME_LENGTH];
+
+    if (argc > 1) {
+      pic_path = argv[1];
+    }
+    init_picstore(&store, STRESS_BUDGET);
+    for (int i = 0; i < PINNED_PICTURES; i++) {
+      pinned_name(name, i);
+      if (!load_picture(&store, pic_path, name)) {
+        exit(IO_ERROR);
+      }
+    }
+
+    for (long i = 0; i < LIST_THREADS; i++) {
+      pthread_create(&list_threads[i], NULL, list, NULL);
+    }
+    for (long i = 0; i < STORM_THREADS; i++) {
+      pthread_create(&storm_threads[i], NULL, storm, (void *) i);
+    }
+    for (int i = 0; i < STORM_THREADS; i++) {
+      pthread_join(storm_threads[i], NULL);
+    }
+    atomic_store(&storm_over, true);
+    for (int i = 0; i < LIST_THREADS; i++) {
+      pthread_join(list_threads[i], NULL);
+    }
+
+    struct snapshot snapshot = { .count = 0, .overflow = false };
+    if (visit_picstore(&store, collect_name, &snapshot) != PINNED_PICTURES) {
+      fail("the store did not end with only the pinned pictures");
+    }
+    printf("store stats: ");
+    print_picstore_stats(&store);
+    // unloaded pictures stop counting as resident straight away
+    for (int i = 0; i < PINNED_PICTURES; i++) {
+      pinned_name(name, i);
+      unload_picture(&store, name);
+    }
+    if (atomic_load(&store.resident_bytes) != 0) {
+      fail("the store still counted pixels once every picture was unloaded");
+    }
+    clear_picstore(&store);
+
+    printf("%ld listings against %d loads and unloads\n", atomic_load(&lists), STORM_THREADS * STORM_ROUNDS);
+    if (atomic_load(&failed)) {
+      printf("store stress test failed\n");
+      return 1;
+    }
+    printf("store stress test passed\n");
+    return 0;
+  }
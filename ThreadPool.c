@@ -1,103 +1,1517 @@
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "ThreadPool.h"
 
+#define DEQUE_INITIAL_SIZE 256
+#define INJECTOR_MAX_BATCH 32
+#define SEGMENT_JOBS 256
+#define RING_DEFAULT_CAPACITY 4096
+#define CACHE_LINE 64
+#define PARALLEL_FOR_CHUNKS_PER_THREAD 4
+#define PARALLEL_FOR_MIN_TILE 16
+#define THREADS_ENV "THREAD_POOL_THREADS"
+#define AFFINITY_ENV "THREAD_POOL_AFFINITY"
+#define CGROUP_V2_CPU_MAX "/sys/fs/cgroup/cpu.max"
+#define CGROUP_V1_CFS_QUOTA "/sys/fs/cgroup/cpu/cpu.cfs_quota_us"
+#define CGROUP_V1_CFS_PERIOD "/sys/fs/cgroup/cpu/cpu.cfs_period_us"
+#define NUMA_NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+#define MAX_NUMA_NODES 64
+
 typedef struct thread_pool_job {
   void *(* job)(void *);
   void *args;
+  // the job is dropped instead of run if this is cancelled first (may be NULL)
+  thread_pool_cancel_token_t *token;
+  // bytes of inline_args holding a copy of the arguments (0 if args is used)
+  u_int32_t args_size;
+  // whether args is a heap copy made by the pool, to be freed after the job
+  bool owns_args;
+  u_int8_t priority;
+  // when the job was queued, if it was sampled for the queue-wait histogram (else 0)
+  long enqueued_ns;
+  _Alignas(max_align_t) unsigned char inline_args[THREAD_POOL_INLINE_ARGS];
 } thread_pool_job_t;
 
-static void *thread_pool_thread_init(void *vtpool);
-static bool thread_pool_push_job(thread_pool_t *tpool, thread_pool_job_t job);
-static thread_pool_job_t *thread_pool_pop_job(thread_pool_t *tpool);
+/* Block of the shared queue. Producers fill jobs from tail, consumers drain
+   them from head, and a full segment is chained to a fresh one via next. */
+typedef struct thread_pool_segment {
+  _Atomic(struct thread_pool_segment *) next;
+  atomic_uint tail;
+  u_int32_t head;
+  thread_pool_job_t jobs[SEGMENT_JOBS];
+} thread_pool_segment_t;
+
+/* Slot of a ring. seq tells producers and consumers whose turn the slot is:
+   it equals the enqueue position for which it is free, and that position
+   plus one once it holds a job. */
+typedef struct thread_pool_ring_slot {
+  atomic_ulong seq;
+  thread_pool_job_t job;
+} thread_pool_ring_slot_t;
+
+/* Bounded multi-producer multi-consumer queue (Vyukov). Producers and
+   consumers each claim a position with a CAS on their own counter, which are
+   kept on separate cache lines, and never wait on one another's locks. */
+typedef struct thread_pool_ring {
+  unsigned long mask;
+  _Alignas(CACHE_LINE) atomic_ulong enqueue_pos;
+  _Alignas(CACHE_LINE) atomic_ulong dequeue_pos;
+  _Alignas(CACHE_LINE) thread_pool_ring_slot_t slots[];
+} thread_pool_ring_t;
+
+/* Circular job buffer backing a deque. Buffers replaced by a resize are kept
+   on a retired list until the pool is destroyed, as a thief may still be
+   reading from them. */
+typedef struct thread_pool_deque_buf {
+  long size;
+  struct thread_pool_deque_buf *retired;
+  thread_pool_job_t jobs[];
+} thread_pool_deque_buf_t;
+
+/* Chase-Lev work-stealing deque. The owning worker pushes and takes at the
+   bottom without locking, while other workers steal from the top. */
+typedef struct thread_pool_deque {
+  atomic_long top;
+  atomic_long bottom;
+  _Atomic(thread_pool_deque_buf_t *) buf;
+} thread_pool_deque_t;
+
+/* Live counters behind thread_pool_stats. Each worker updates its own, on its
+   own cache line; threads outside the pool share the pool's external ones. */
+typedef struct thread_pool_counters {
+  atomic_long jobs;
+  atomic_long idle_ns;
+  // start of the wait for work in progress, or 0 when not waiting
+  atomic_long idle_since;
+  atomic_long lock_waits;
+  atomic_long steals;
+  atomic_long queue_wait[THREAD_POOL_WAIT_BUCKETS];
+} thread_pool_counters_t;
+
+typedef struct thread_pool_worker {
+  thread_pool_t *tpool;
+  pthread_t thread;
+  u_int32_t index;
+  u_int32_t rand_state;
+  long started_ns;
+  thread_pool_deque_t deque;
+  _Alignas(CACHE_LINE) thread_pool_counters_t counters;
+} thread_pool_worker_t;
+
+/* Shared state of one parallel_for call, living on the caller's stack. The
+   iteration space is cut into fixed chunks (ranges or tiles) which are then
+   handed out by recursively halving the chunk index range. */
+typedef struct parallel_for_call {
+  thread_pool_t *tpool;
+  void (* run_chunk)(struct parallel_for_call *call, long chunk);
+  void *ctx;
+  thread_pool_range_fn *range_fn;
+  thread_pool_tile_fn *tile_fn;
+  long begin;
+  long end;
+  long grain;
+  long y_begin;
+  long y_end;
+  long grain_y;
+  long tiles_x;
+  // priority and token of the calling job, which the chunks run with
+  thread_pool_priority_t priority;
+  thread_pool_cancel_token_t *token;
+  atomic_long remaining_chunks;
+  bool done;
+  pthread_mutex_t done_lock;
+  pthread_cond_t done_cond;
+} parallel_for_call_t;
+
+/* Argument of the job covering chunks [first, end), stored inline in the job. */
+typedef struct parallel_for_split {
+  parallel_for_call_t *call;
+  long first;
+  long end;
+} parallel_for_split_t;
+
+/* Handle on a job submitted with thread_pool_submit. It is shared between the
+   submitter and the pool, and freed once both have released it. */
+struct thread_pool_future {
+  thread_pool_t *tpool;
+  void *(* job)(void *);
+  void *args;
+  void *result;
+  thread_pool_priority_t priority;
+  thread_pool_cancel_token_t *token;
+  atomic_int refs;
+  // dependencies still running, plus one held by thread_pool_submit itself
+  atomic_int unmet_deps;
+  atomic_bool done;
+  // whether the job was skipped because token was cancelled before it started
+  atomic_bool cancelled;
+  // guards done_cond and dependents
+  pthread_mutex_t lock;
+  pthread_cond_t done_cond;
+  struct future_dependent *dependents;
+};
+
+/* Entry in a future's list of futures waiting for it to finish. */
+typedef struct future_dependent {
+  thread_pool_future_t *future;
+  struct future_dependent *next;
+} future_dependent_t;
+
+// worker owned by the calling thread (NULL outside of any thread pool)
+static _Thread_local thread_pool_worker_t *current_worker = NULL;
+// victim selection state for threads helping a pool they are not part of
+static _Thread_local u_int32_t helper_rand_state = 1;
+// priority and token of the job the calling thread is running, inherited by
+// the jobs it submits
+static _Thread_local thread_pool_priority_t current_priority = THREAD_POOL_PRIORITY_NORMAL;
+static _Thread_local thread_pool_cancel_token_t *current_token = NULL;
+// jobs queued by the calling thread, to pick the ones sampled for queue waits
+static _Thread_local u_int32_t wait_sample_tick = 0;
+
+static void *thread_pool_thread_init(void *vworker);
+static bool thread_pool_find_job(thread_pool_t *tpool, thread_pool_worker_t *worker, thread_pool_job_t *job);
+static bool thread_pool_enqueue(thread_pool_t *tpool, thread_pool_job_t *job);
+static void thread_pool_set_job_opts(thread_pool_job_t *job, const thread_pool_job_opts_t *opts);
+static void thread_pool_call_job(thread_pool_job_t *job);
+static void thread_pool_run_job(thread_pool_t *tpool, thread_pool_job_t *job);
+static long now_ns(void);
+static void counters_init(thread_pool_counters_t *counters);
+static thread_pool_counters_t *thread_pool_counters(thread_pool_t *tpool);
+static void lock_counted(thread_pool_t *tpool, pthread_mutex_t *lock);
+static void worker_stats(thread_pool_counters_t *counters, long lifetime_ns, long now,
+                         thread_pool_worker_stats_t *stats);
+static bool thread_pool_help(thread_pool_t *tpool);
+static void parallel_for_run(parallel_for_call_t *call, long chunks);
+static void parallel_for_chunks(parallel_for_call_t *call, long first, long end);
+static void *parallel_for_job(void *vsplit);
+static void parallel_for_range_chunk(parallel_for_call_t *call, long chunk);
+static void parallel_for_tile_chunk(parallel_for_call_t *call, long chunk);
+static void future_dep_met(thread_pool_future_t *future);
+static void *future_run_job(void *vfuture);
+static void thread_pool_wait_for_work(thread_pool_t *tpool);
+static void thread_pool_finish_job(thread_pool_t *tpool);
+static bool thread_pool_over_high_water(thread_pool_t *tpool);
+static bool thread_pool_wait_for_space(thread_pool_t *tpool);
+static void queue_init(thread_pool_queue_t *queue, u_int32_t ring_capacity);
+static void queue_destroy(thread_pool_queue_t *queue);
+static bool thread_pool_push_job(thread_pool_t *tpool, thread_pool_queue_t *queue, thread_pool_job_t job);
+static bool thread_pool_pop_job(thread_pool_t *tpool, thread_pool_queue_t *queue, thread_pool_job_t *job);
+static bool thread_pool_pop_job_locked(thread_pool_queue_t *queue, thread_pool_job_t *job);
+static thread_pool_segment_t *segment_new(thread_pool_queue_t *queue);
+static thread_pool_ring_t *ring_new(u_int32_t capacity);
+static bool ring_push(thread_pool_ring_t *ring, thread_pool_job_t *job);
+static bool ring_pop(thread_pool_ring_t *ring, thread_pool_job_t *job);
+static u_int32_t thread_pool_pop_batch(thread_pool_worker_t *worker, thread_pool_job_t *job);
+static long cgroup_cpu_limit(void);
+static bool read_cpulist(const char *path, cpu_set_t *cpus);
+static void pin_worker(thread_pool_worker_t *worker, thread_pool_affinity_t affinity);
+static void deque_init(thread_pool_deque_t *deque);
+static void deque_destroy(thread_pool_deque_t *deque);
+static void deque_push(thread_pool_deque_t *deque, thread_pool_job_t job);
+static bool deque_take(thread_pool_deque_t *deque, thread_pool_job_t *job);
+static bool deque_steal(thread_pool_deque_t *deque, thread_pool_job_t *job);
 
-/* Initialises a thread pool with the provided max_threads and job capacity. */
-void thread_pool_init(thread_pool_t *tpool, u_int32_t max_threads, u_int32_t capacity) {
+/* Initialises a work-stealing thread pool with the provided max_threads (0 for
+   thread_pool_default_threads) and high-water mark of queued jobs (0 for no limit). */
+void thread_pool_init(thread_pool_t *tpool, u_int32_t max_threads, u_int32_t high_water) {
+  thread_pool_init_backend(tpool, max_threads, high_water, THREAD_POOL_WORK_STEALING);
+}
+
+/* Initialises a thread pool with the provided max_threads, high-water mark of
+   queued jobs and scheduling backend. The worker threads are started straight
+   away and sleep until jobs arrive, so they are reused by every job submitted
+   over the lifetime of the pool, and are pinned according to
+   thread_pool_default_affinity. Submitters block at the high-water mark
+   unless thread_pool_set_overflow says otherwise. The THREAD_POOL_MPMC_RING
+   backend is always bounded: its ring holds high_water jobs rounded up to a
+   power of two (RING_DEFAULT_CAPACITY if high_water is 0). */
+void thread_pool_init_backend(thread_pool_t *tpool, u_int32_t max_threads, u_int32_t high_water,
+                              thread_pool_backend_t backend) {
+  if (max_threads == 0)
+    max_threads = thread_pool_default_threads();
+
+  tpool->backend = backend;
   tpool->max_threads = max_threads;
-  tpool->capacity = capacity;
-  tpool->q_size = 0;
-  tpool->job_q = malloc(capacity * sizeof(thread_pool_job_t));
-  pthread_mutex_init(&tpool->q_lock, NULL);
+  tpool->high_water = high_water;
+  tpool->overflow = THREAD_POOL_OVERFLOW_BLOCK;
+
+  u_int32_t ring_capacity = 0;
+  if (backend == THREAD_POOL_MPMC_RING) {
+    ring_capacity = 1;
+    while (ring_capacity < (high_water > 0 ? high_water : RING_DEFAULT_CAPACITY))
+      ring_capacity *= 2;
+    if (high_water == 0)
+      tpool->high_water = ring_capacity;
+  }
+  // High priority jobs are never throttled, so only the normal queue is bounded.
+  for (int p = 0; p < THREAD_POOL_PRIORITIES; p++)
+    queue_init(&tpool->queues[p], p == THREAD_POOL_PRIORITY_NORMAL ? ring_capacity : 0);
+  atomic_init(&tpool->pending_jobs, 0);
+  atomic_init(&tpool->unfinished_jobs, 0);
+  atomic_init(&tpool->sleeping_workers, 0);
+  atomic_init(&tpool->blocked_submitters, 0);
+  atomic_init(&tpool->shutdown, false);
+  atomic_init(&tpool->count_allocs, false);
+  atomic_init(&tpool->avoided_allocs, 0);
+  pthread_mutex_init(&tpool->sleep_lock, NULL);
+  pthread_cond_init(&tpool->work_available, NULL);
+  pthread_cond_init(&tpool->space_available, NULL);
+  pthread_cond_init(&tpool->idle, NULL);
+
+  tpool->external_counters = malloc(sizeof(thread_pool_counters_t));
+  counters_init(tpool->external_counters);
+
+  // Aligned so that no two workers' counters share a cache line.
+  tpool->workers = aligned_alloc(CACHE_LINE, max_threads * sizeof(thread_pool_worker_t));
+  for (int i = 0; i < max_threads; i++) {
+    thread_pool_worker_t *worker = &tpool->workers[i];
+    worker->tpool = tpool;
+    worker->index = i;
+    worker->rand_state = 2654435761u * (i + 1);
+    worker->started_ns = now_ns();
+    deque_init(&worker->deque);
+    counters_init(&worker->counters);
+  }
+
+  // Creates and stores number of threads that the thread pool supports.
+  for (int i = 0; i < max_threads; i++)
+    pthread_create(&tpool->workers[i].thread, NULL, &thread_pool_thread_init, &tpool->workers[i]);
+
+  tpool->affinity = THREAD_POOL_PIN_NONE;
+  thread_pool_set_affinity(tpool, thread_pool_default_affinity());
 }
 
-/* Submits a job to the thread_pool with provided args. 
-   Returns whether submission was successful. */
-bool thread_pool_submit_job(thread_pool_t *tpool, void *(* job)(void *), void *args) {
-  thread_pool_job_t j = { job, args };
-  bool pushed = thread_pool_push_job(tpool, j);
-  if (!pushed)
-    perror("Capacity of thread pool has been exceeded.");
+/* Returns the number of workers a pool should use on this machine: the
+   THREAD_POOL_THREADS environment variable if set, otherwise the number of
+   CPUs this process may run on, capped by any cgroup CPU quota. */
+u_int32_t thread_pool_default_threads(void) {
+  const char *env = getenv(THREADS_ENV);
+  if (env != NULL && atol(env) > 0)
+    return atol(env);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) < cpus)
+    cpus = CPU_COUNT(&allowed);
+
+  long quota = cgroup_cpu_limit();
+  if (quota > 0 && quota < cpus)
+    cpus = quota;
 
-  return pushed;
+  return cpus > 0 ? cpus : 1;
 }
 
-/* Creates all the threads possible for the thread pool and finishes all jobs
-   in the job queue. */
-void thread_pool_run_and_wait(thread_pool_t *tpool) {
-  pthread_t *threads = malloc(tpool->max_threads * sizeof(pthread_t));
+/* Returns the pinning requested by the THREAD_POOL_AFFINITY environment
+   variable ("cores" or "numa"), or THREAD_POOL_PIN_NONE. */
+thread_pool_affinity_t thread_pool_default_affinity(void) {
+  const char *env = getenv(AFFINITY_ENV);
+  if (env == NULL)
+    return THREAD_POOL_PIN_NONE;
+  if (strcmp(env, "cores") == 0)
+    return THREAD_POOL_PIN_CORES;
+  if (strcmp(env, "numa") == 0)
+    return THREAD_POOL_PIN_NUMA;
+  return THREAD_POOL_PIN_NONE;
+}
 
-  // Creates and stores number of threads that the thread pool supports.
+/* Pins the pool's workers: round-robin one per CPU (THREAD_POOL_PIN_CORES),
+   round-robin one per NUMA node's CPUs (THREAD_POOL_PIN_NUMA), or lets them
+   run on any CPU the process may use (THREAD_POOL_PIN_NONE). Only CPUs in the
+   process's own affinity mask are ever used. */
+void thread_pool_set_affinity(thread_pool_t *tpool, thread_pool_affinity_t affinity) {
+  if (affinity == tpool->affinity)
+    return;
+
+  tpool->affinity = affinity;
   for (int i = 0; i < tpool->max_threads; i++)
-    pthread_create(&threads[i], NULL, &thread_pool_thread_init, tpool);
-    
+    pin_worker(&tpool->workers[i], affinity);
+}
+
+/* Sets what submitters do once the pool holds high_water queued jobs. */
+void thread_pool_set_overflow(thread_pool_t *tpool, thread_pool_overflow_t overflow) {
+  tpool->overflow = overflow;
+}
+
+/* Submits a job to the thread_pool with provided args, with the priority and
+   cancellation token of the calling job (see thread_pool_submit_job_opts).
+   Returns whether submission was successful (fails once the pool is being destroyed). */
+bool thread_pool_submit_job(thread_pool_t *tpool, void *(* job)(void *), void *args) {
+  return thread_pool_submit_job_opts(tpool, job, args, NULL);
+}
+
+/* Submits a job with the given priority and cancellation token (NULL opts to
+   inherit those of the calling job). Normal jobs submitted from one of the
+   pool's own workers go onto that worker's deque; all other jobs go through
+   the shared queue of their priority, which grows as needed. Once high_water
+   jobs are queued normal submitters are throttled by the overflow policy, so
+   no job is lost. Returns whether submission was successful. */
+bool thread_pool_submit_job_opts(thread_pool_t *tpool, void *(* job)(void *), void *args,
+                                 const thread_pool_job_opts_t *opts) {
+  thread_pool_job_t j;
+  j.job = job;
+  j.args = args;
+  j.args_size = 0;
+  j.owns_args = false;
+  thread_pool_set_job_opts(&j, opts);
+
+  return thread_pool_enqueue(tpool, &j);
+}
+
+/* Submits a job that receives its own copy of the size bytes at args, with the
+   priority and cancellation token of the calling job. Returns whether
+   submission was successful. */
+bool thread_pool_submit_job_copy(thread_pool_t *tpool, void *(* job)(void *), const void *args, size_t size) {
+  return thread_pool_submit_job_copy_opts(tpool, job, args, size, NULL);
+}
+
+/* Submits a job that receives its own copy of the size bytes at args, so the
+   caller needs no per-job allocation and may reuse args straight away.
+   Arguments of up to THREAD_POOL_INLINE_ARGS bytes are stored inside the job
+   itself; larger ones are copied to the heap and freed after the job runs.
+   Returns whether submission was successful. */
+bool thread_pool_submit_job_copy_opts(thread_pool_t *tpool, void *(* job)(void *), const void *args, size_t size,
+                                      const thread_pool_job_opts_t *opts) {
+  thread_pool_job_t j;
+  j.job = job;
+  thread_pool_set_job_opts(&j, opts);
+
+  if (size <= THREAD_POOL_INLINE_ARGS) {
+    j.args = NULL;
+    j.args_size = size;
+    j.owns_args = false;
+    memcpy(j.inline_args, args, size);
+    if (atomic_load_explicit(&tpool->count_allocs, memory_order_relaxed))
+      atomic_fetch_add_explicit(&tpool->avoided_allocs, 1, memory_order_relaxed);
+  } else {
+    j.args = malloc(size);
+    j.args_size = 0;
+    j.owns_args = true;
+    memcpy(j.args, args, size);
+  }
+
+  return thread_pool_enqueue(tpool, &j);
+}
+
+/* Turns counting of the argument allocations avoided by
+   thread_pool_submit_job_copy on or off. Off by default. */
+void thread_pool_set_alloc_counting(thread_pool_t *tpool, bool enabled) {
+  atomic_store(&tpool->count_allocs, enabled);
+}
+
+/* Returns the number of jobs whose arguments were stored inline rather than
+   heap allocated while allocation counting was on. */
+long thread_pool_avoided_allocs(thread_pool_t *tpool) {
+  return atomic_load(&tpool->avoided_allocs);
+}
+
+/* Returns a snapshot of the pool's counters, to be freed by the caller.
+   The counters are kept up to date cheaply enough to always be on: busy and
+   idle time are only measured around waits for work, and only one in
+   THREAD_POOL_WAIT_SAMPLE queued jobs is timed. */
+thread_pool_stats_t *thread_pool_stats(thread_pool_t *tpool) {
+  thread_pool_stats_t *stats = malloc(sizeof(thread_pool_stats_t)
+                                      + tpool->max_threads * sizeof(thread_pool_worker_stats_t));
+  long now = now_ns();
+
+  stats->backend = tpool->backend;
+  stats->num_workers = tpool->max_threads;
+  worker_stats(tpool->external_counters, 0, now, &stats->external);
+  for (int b = 0; b < THREAD_POOL_WAIT_BUCKETS; b++)
+    stats->queue_wait[b] = atomic_load_explicit(&tpool->external_counters->queue_wait[b], memory_order_relaxed);
+
+  for (int i = 0; i < tpool->max_threads; i++) {
+    thread_pool_worker_t *worker = &tpool->workers[i];
+    worker_stats(&worker->counters, now - worker->started_ns, now, &stats->workers[i]);
+    for (int b = 0; b < THREAD_POOL_WAIT_BUCKETS; b++)
+      stats->queue_wait[b] += atomic_load_explicit(&worker->counters.queue_wait[b], memory_order_relaxed);
+  }
+
+  return stats;
+}
+
+/* Writes a stats snapshot to file as a single-line JSON object. */
+void thread_pool_stats_json(FILE *file, const thread_pool_stats_t *stats) {
+  const thread_pool_worker_stats_t *ext = &stats->external;
+
+  fprintf(file, "{\"backend\": \"%s\", ", thread_pool_backend_name(stats->backend));
+  fprintf(file, "\"external\": {\"jobs\": %ld, \"lock_waits\": %ld}, ", ext->jobs, ext->lock_waits);
+
+  fprintf(file, "\"workers\": [");
+  for (int i = 0; i < stats->num_workers; i++) {
+    const thread_pool_worker_stats_t *w = &stats->workers[i];
+    fprintf(file, "%s{\"jobs\": %ld, \"busy_ns\": %ld, \"idle_ns\": %ld, \"lock_waits\": %ld, \"steals\": %ld}",
+            i > 0 ? ", " : "", w->jobs, w->busy_ns, w->idle_ns, w->lock_waits, w->steals);
+  }
+
+  // Non-empty buckets only, keyed by their lower bound (2^i ns).
+  fprintf(file, "], \"queue_wait_sample_rate\": %d, \"queue_wait_ns\": {", THREAD_POOL_WAIT_SAMPLE);
+  bool first = true;
+  for (int b = 0; b < THREAD_POOL_WAIT_BUCKETS; b++) {
+    if (stats->queue_wait[b] == 0)
+      continue;
+    fprintf(file, "%s\"%ld\": %ld", first ? "" : ", ", 1L << b, stats->queue_wait[b]);
+    first = false;
+  }
+  fprintf(file, "}}\n");
+}
+
+/* Initialises a cancellation token that has not been cancelled. */
+void thread_pool_cancel_token_init(thread_pool_cancel_token_t *token) {
+  atomic_init(&token->cancelled, false);
+}
+
+/* Cancels every job submitted with the token: those that have not started yet
+   are dropped, and running ones see thread_pool_cancel_requested return true. */
+void thread_pool_cancel(thread_pool_cancel_token_t *token) {
+  atomic_store(&token->cancelled, true);
+}
+
+/* Returns whether the token (which may be NULL) has been cancelled. */
+bool thread_pool_cancelled(thread_pool_cancel_token_t *token) {
+  return token != NULL && atomic_load_explicit(&token->cancelled, memory_order_relaxed);
+}
+
+/* Returns whether the job running on the calling thread has been cancelled,
+   so long-running jobs can poll it and stop early. */
+bool thread_pool_cancel_requested(void) {
+  return thread_pool_cancelled(current_token);
+}
+
+/* Blocks until every submitted job has finished.
+   Must not be called from inside a job, as that job would wait on itself. */
+void thread_pool_wait_idle(thread_pool_t *tpool) {
+  pthread_mutex_lock(&tpool->sleep_lock);
+
+  while (atomic_load(&tpool->unfinished_jobs) > 0)
+    pthread_cond_wait(&tpool->idle, &tpool->sleep_lock);
+
+  pthread_mutex_unlock(&tpool->sleep_lock);
+}
+
+/* Finishes any outstanding jobs, stops the worker threads and frees
+   resources used by a thread pool. */
+void thread_pool_destroy(thread_pool_t *tpool) {
+  thread_pool_wait_idle(tpool);
+
+  pthread_mutex_lock(&tpool->sleep_lock);
+  atomic_store(&tpool->shutdown, true);
+  pthread_cond_broadcast(&tpool->work_available);
+  pthread_mutex_unlock(&tpool->sleep_lock);
+
   // Waits for all the threads to finish.
   for (int i = 0; i < tpool->max_threads; i++)
-    pthread_join(threads[i], NULL);
-   
-  free(threads);
+    pthread_join(tpool->workers[i].thread, NULL);
+
+  for (int i = 0; i < tpool->max_threads; i++)
+    deque_destroy(&tpool->workers[i].deque);
+
+  free(tpool->workers);
+  free(tpool->external_counters);
+  for (int p = 0; p < THREAD_POOL_PRIORITIES; p++)
+    queue_destroy(&tpool->queues[p]);
+  pthread_cond_destroy(&tpool->idle);
+  pthread_cond_destroy(&tpool->space_available);
+  pthread_cond_destroy(&tpool->work_available);
+  pthread_mutex_destroy(&tpool->sleep_lock);
 }
 
-/* Frees resources used by a thread pool. */
-void thread_pool_destroy(thread_pool_t *tpool) {
-  free(tpool->job_q);
+/* Returns a grain size that splits n iterations into a few chunks per worker,
+   but no chunks smaller than min_grain. */
+long thread_pool_auto_grain(thread_pool_t *tpool, long n, long min_grain) {
+  long chunks = (long) tpool->max_threads * PARALLEL_FOR_CHUNKS_PER_THREAD;
+  long grain = (n + chunks - 1) / chunks;
+
+  if (grain < min_grain)
+    grain = min_grain;
+  return grain < 1 ? 1 : grain;
+}
+
+/* Calls fn(ctx, b, e) over consecutive sub-ranges [b, e) covering [begin, end),
+   each at most grain long (0 picks one with thread_pool_auto_grain), in
+   parallel on the pool. Returns once every sub-range has been processed; the
+   calling thread runs chunks itself while it waits, so this may be nested
+   inside jobs. No memory is allocated per job. The chunks run at the calling
+   job's priority, and the ones not started yet are skipped if its
+   cancellation token is cancelled. */
+void thread_pool_parallel_for(thread_pool_t *tpool, long begin, long end, long grain,
+                              thread_pool_range_fn *fn, void *ctx) {
+  if (end <= begin)
+    return;
+
+  parallel_for_call_t call;
+  call.tpool = tpool;
+  call.run_chunk = &parallel_for_range_chunk;
+  call.ctx = ctx;
+  call.range_fn = fn;
+  call.begin = begin;
+  call.end = end;
+  call.grain = grain > 0 ? grain : thread_pool_auto_grain(tpool, end - begin, 1);
+
+  parallel_for_run(&call, (end - begin + call.grain - 1) / call.grain);
+}
+
+/* Calls fn(ctx, x0, x1, y0, y1) over tiles of at most grain_x by grain_y
+   covering [x_begin, x_end) x [y_begin, y_end), in parallel on the pool.
+   A non-positive grain picks square tiles giving a few per worker.
+   Returns once every tile has been processed (see thread_pool_parallel_for). */
+void thread_pool_parallel_for_2d(thread_pool_t *tpool, long x_begin, long x_end, long y_begin, long y_end,
+                                 long grain_x, long grain_y, thread_pool_tile_fn *fn, void *ctx) {
+  if (x_end <= x_begin || y_end <= y_begin)
+    return;
+
+  long width = x_end - x_begin;
+  long height = y_end - y_begin;
+
+  if (grain_x <= 0 || grain_y <= 0) {
+    // Doubles the tile side until there are few enough tiles to go round.
+    long target = (long) tpool->max_threads * PARALLEL_FOR_CHUNKS_PER_THREAD;
+    long side = PARALLEL_FOR_MIN_TILE;
+    while (((width + side - 1) / side) * ((height + side - 1) / side) > target)
+      side *= 2;
+    grain_x = side;
+    grain_y = side;
+  }
+
+  parallel_for_call_t call;
+  call.tpool = tpool;
+  call.run_chunk = &parallel_for_tile_chunk;
+  call.ctx = ctx;
+  call.tile_fn = fn;
+  call.begin = x_begin;
+  call.end = x_end;
+  call.grain = grain_x;
+  call.y_begin = y_begin;
+  call.y_end = y_end;
+  call.grain_y = grain_y;
+  call.tiles_x = (width + grain_x - 1) / grain_x;
+
+  parallel_for_run(&call, call.tiles_x * ((height + grain_y - 1) / grain_y));
+}
+
+/* Submits a job that only becomes runnable once every future in deps (which
+   may be NULL when num_deps is 0) has finished, so chains of dependent jobs
+   can be queued up front without waiting in between.
+   Returns a future for the job, to be released with thread_pool_future_release. */
+thread_pool_future_t *thread_pool_submit(thread_pool_t *tpool, void *(* job)(void *), void *args,
+                                         thread_pool_future_t **deps, u_int32_t num_deps) {
+  return thread_pool_submit_opts(tpool, job, args, deps, num_deps, NULL);
+}
+
+/* Submits a dependent job (see thread_pool_submit) with the given priority and
+   cancellation token (NULL opts to inherit those of the calling job). A job
+   cancelled before it starts is skipped but its future still completes, with
+   a NULL result, so that waiters and dependents are not left hanging. */
+thread_pool_future_t *thread_pool_submit_opts(thread_pool_t *tpool, void *(* job)(void *), void *args,
+                                              thread_pool_future_t **deps, u_int32_t num_deps,
+                                              const thread_pool_job_opts_t *opts) {
+  thread_pool_future_t *future = malloc(sizeof(thread_pool_future_t));
+  future->tpool = tpool;
+  future->job = job;
+  future->args = args;
+  future->result = NULL;
+  future->priority = opts != NULL ? opts->priority : current_priority;
+  future->token = opts != NULL ? opts->token : current_token;
+  future->dependents = NULL;
+  // one reference for the caller and one for the pool until the job has run
+  atomic_init(&future->refs, 2);
+  atomic_init(&future->unmet_deps, num_deps + 1);
+  atomic_init(&future->done, false);
+  atomic_init(&future->cancelled, false);
+  pthread_mutex_init(&future->lock, NULL);
+  pthread_cond_init(&future->done_cond, NULL);
+
+  for (u_int32_t i = 0; i < num_deps; i++) {
+    thread_pool_future_t *dep = deps[i];
+    pthread_mutex_lock(&dep->lock);
+    if (atomic_load(&dep->done)) {
+      pthread_mutex_unlock(&dep->lock);
+      future_dep_met(future);
+      continue;
+    }
+    future_dependent_t *entry = malloc(sizeof(future_dependent_t));
+    entry->future = future;
+    entry->next = dep->dependents;
+    dep->dependents = entry;
+    pthread_mutex_unlock(&dep->lock);
+  }
+
+  // Drops the submission's own hold, queueing the job if nothing is pending.
+  future_dep_met(future);
+  return future;
+}
+
+/* Returns whether the future's job has finished. */
+bool thread_pool_future_done(thread_pool_future_t *future) {
+  return atomic_load(&future->done);
+}
+
+/* Returns whether the future's job was skipped because it was cancelled. */
+bool thread_pool_future_cancelled(thread_pool_future_t *future) {
+  return atomic_load(&future->cancelled);
+}
+
+/* Blocks until the future's job has finished, running other queued jobs in
+   the meantime, so it is safe to call from inside a job.
+   Returns the value the job returned. */
+void *thread_pool_future_wait(thread_pool_future_t *future) {
+  while (!atomic_load(&future->done) && thread_pool_help(future->tpool))
+    ;
+
+  pthread_mutex_lock(&future->lock);
+  while (!atomic_load(&future->done))
+    pthread_cond_wait(&future->done_cond, &future->lock);
+  pthread_mutex_unlock(&future->lock);
+
+  return future->result;
+}
+
+/* Gives up the caller's handle on a future. The job still runs if it has
+   not yet, and the future is freed once it has. */
+void thread_pool_future_release(thread_pool_future_t *future) {
+  if (atomic_fetch_sub(&future->refs, 1) == 1) {
+    pthread_cond_destroy(&future->done_cond);
+    pthread_mutex_destroy(&future->lock);
+    free(future);
+  }
 }
 
-/* Wrapper around jobs for thread pool threads. 
-   This allows for threads to be preserved in between jobs. */
-static void *thread_pool_thread_init(void *vtpool) {
-  thread_pool_t *tpool = (thread_pool_t *) vtpool;
-  thread_pool_job_t *tpool_job = thread_pool_pop_job(tpool);
+/* Returns the whole number of CPUs allowed by the cgroup (v2 or v1) CPU quota,
+   rounded up, or 0 if there is no quota. */
+static long cgroup_cpu_limit(void) {
+  long quota = 0;
+  long period = 0;
+  char buf[64];
 
-  while (tpool_job != NULL) {
-    tpool_job->job(tpool_job->args);
-    tpool_job = thread_pool_pop_job(tpool);
+  FILE *file = fopen(CGROUP_V2_CPU_MAX, "r");
+  if (file != NULL) {
+    // "max <period>" when unlimited, "<quota> <period>" otherwise
+    if (fscanf(file, "%63s %ld", buf, &period) == 2 && strcmp(buf, "max") != 0)
+      quota = atol(buf);
+    fclose(file);
+  } else {
+    file = fopen(CGROUP_V1_CFS_QUOTA, "r");
+    if (file != NULL) {
+      if (fscanf(file, "%ld", &quota) != 1)
+        quota = 0;
+      fclose(file);
+    }
+    file = fopen(CGROUP_V1_CFS_PERIOD, "r");
+    if (file != NULL) {
+      if (fscanf(file, "%ld", &period) != 1)
+        period = 0;
+      fclose(file);
+    }
   }
 
+  if (quota <= 0 || period <= 0)
+    return 0;
+  return (quota + period - 1) / period;
+}
+
+/* Reads a kernel CPU list such as "0-3,8,10-11" into cpus.
+   Returns whether the file could be read. */
+static bool read_cpulist(const char *path, cpu_set_t *cpus) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return false;
+
+  CPU_ZERO(cpus);
+  int first;
+  while (fscanf(file, "%d", &first) == 1) {
+    int last = first;
+    int sep = fgetc(file);
+    if (sep == '-') {
+      if (fscanf(file, "%d", &last) != 1)
+        break;
+      sep = fgetc(file);
+    }
+    for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, cpus);
+    if (sep != ',')
+      break;
+  }
+
+  fclose(file);
+  return true;
+}
+
+/* Applies the given affinity to one worker thread (see thread_pool_set_affinity). */
+static void pin_worker(thread_pool_worker_t *worker, thread_pool_affinity_t affinity) {
+  cpu_set_t allowed;
+  cpu_set_t target;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return;
+  target = allowed;
+
+  if (affinity == THREAD_POOL_PIN_CORES) {
+    // The index-th allowed CPU, wrapping round if there are more workers.
+    int nth = worker->index % CPU_COUNT(&allowed);
+    CPU_ZERO(&target);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed) && nth-- == 0) {
+        CPU_SET(cpu, &target);
+        break;
+      }
+    }
+  } else if (affinity == THREAD_POOL_PIN_NUMA) {
+    cpu_set_t nodes[MAX_NUMA_NODES];
+    int num_nodes = 0;
+    char path[64];
+
+    // Only nodes that share CPUs with this process are candidates.
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+      snprintf(path, sizeof(path), NUMA_NODE_CPULIST, node);
+      cpu_set_t node_cpus;
+      if (!read_cpulist(path, &node_cpus))
+        continue;
+      CPU_AND(&nodes[num_nodes], &node_cpus, &allowed);
+      if (CPU_COUNT(&nodes[num_nodes]) > 0)
+        num_nodes++;
+    }
+
+    if (num_nodes > 0)
+      target = nodes[worker->index % num_nodes];
+  }
+
+  pthread_setaffinity_np(worker->thread, sizeof(target), &target);
+}
+
+/* Returns a printable name for a thread pool backend. */
+const char *thread_pool_backend_name(thread_pool_backend_t backend) {
+  switch (backend) {
+    case THREAD_POOL_MUTEX_QUEUE:
+      return "mutex queue";
+    case THREAD_POOL_WORK_STEALING:
+      return "work stealing";
+    case THREAD_POOL_MPMC_RING:
+      return "lock-free ring";
+  }
+  return "unknown";
+}
+
+/* Wrapper around jobs for thread pool threads.
+   This allows for threads to be preserved in between jobs: a worker sleeps
+   until a job is available and only exits once the pool is shut down. */
+static void *thread_pool_thread_init(void *vworker) {
+  thread_pool_worker_t *worker = (thread_pool_worker_t *) vworker;
+  thread_pool_t *tpool = worker->tpool;
+  thread_pool_job_t tpool_job;
+
+  current_worker = worker;
+
+  while (!atomic_load(&tpool->shutdown)) {
+    if (thread_pool_find_job(tpool, worker, &tpool_job))
+      thread_pool_run_job(tpool, &tpool_job);
+    else
+      thread_pool_wait_for_work(tpool);
+  }
+
+  current_worker = NULL;
   return NULL;
 }
 
-/* Atomically pushes a job into the thread pool's queue. 
-   Returns whether the push was successful (if the capacity wasn't exceeded). */
-static bool thread_pool_push_job(thread_pool_t *tpool, thread_pool_job_t job) {
-  pthread_mutex_lock(&tpool->q_lock);
+/* Queues a prepared job: high priority jobs onto the high priority queue,
+   others onto the calling worker's deque if it belongs to the pool, or else
+   onto the normal queue subject to the overflow policy.
+   Returns whether the job was accepted (run inline counts as accepted). */
+static bool thread_pool_enqueue(thread_pool_t *tpool, thread_pool_job_t *job) {
+  thread_pool_worker_t *worker = current_worker;
+  bool own_worker = worker != NULL && worker->tpool == tpool;
+
+  atomic_fetch_add(&tpool->unfinished_jobs, 1);
+
+  if (++wait_sample_tick % THREAD_POOL_WAIT_SAMPLE == 0)
+    job->enqueued_ns = now_ns();
+  else
+    job->enqueued_ns = 0;
+
+  if (job->priority != THREAD_POOL_PRIORITY_NORMAL) {
+    thread_pool_push_job(tpool, &tpool->queues[job->priority], *job);
+  } else if (own_worker && tpool->backend == THREAD_POOL_WORK_STEALING) {
+    deque_push(&worker->deque, *job);
+  } else {
+    thread_pool_queue_t *queue = &tpool->queues[THREAD_POOL_PRIORITY_NORMAL];
+    // A full ring is handled like the high-water mark being reached.
+    while (thread_pool_over_high_water(tpool) || !thread_pool_push_job(tpool, queue, *job)) {
+      // A worker must not wait for queue space that only the workers can
+      // free, so it always runs the job itself instead.
+      if (own_worker || tpool->overflow == THREAD_POOL_OVERFLOW_RUN_INLINE) {
+        thread_pool_call_job(job);
+        thread_pool_finish_job(tpool);
+        return true;
+      }
+      if (!thread_pool_wait_for_space(tpool)) {
+        if (job->owns_args)
+          free(job->args);
+        thread_pool_finish_job(tpool);
+        perror("Thread pool is shutting down.");
+        return false;
+      }
+    }
+  }
+
+  // Wakes a sleeping worker if there is one. The seq_cst increment pairs with
+  // the sleeping_workers increment in thread_pool_wait_for_work.
+  atomic_fetch_add(&tpool->pending_jobs, 1);
+  if (atomic_load(&tpool->sleeping_workers) > 0) {
+    pthread_mutex_lock(&tpool->sleep_lock);
+    pthread_cond_signal(&tpool->work_available);
+    pthread_mutex_unlock(&tpool->sleep_lock);
+  }
+
+  return true;
+}
+
+/* Fills in the priority and token of a job from opts, or from the job the
+   calling thread is running if opts is NULL. */
+static void thread_pool_set_job_opts(thread_pool_job_t *job, const thread_pool_job_opts_t *opts) {
+  job->priority = opts != NULL ? opts->priority : current_priority;
+  job->token = opts != NULL ? opts->token : current_token;
+}
+
+/* Calls a job with its arguments, which for inline arguments live in this
+   copy of the job, then frees any heap copy of them. A job whose token has
+   been cancelled is dropped without being called. */
+static void thread_pool_call_job(thread_pool_job_t *job) {
+  if (!thread_pool_cancelled(job->token)) {
+    // Saved and restored, as a job may run other jobs while it waits.
+    thread_pool_priority_t caller_priority = current_priority;
+    thread_pool_cancel_token_t *caller_token = current_token;
+    current_priority = job->priority;
+    current_token = job->token;
+
+    job->job(job->args_size > 0 ? (void *) job->inline_args : job->args);
+
+    current_priority = caller_priority;
+    current_token = caller_token;
+  }
 
-  if (tpool->q_size == tpool->capacity) {
-    pthread_mutex_unlock(&tpool->q_lock);
+  if (job->owns_args)
+    free(job->args);
+}
+
+/* Runs a job taken off one of the pool's queues and accounts for it. */
+static void thread_pool_run_job(thread_pool_t *tpool, thread_pool_job_t *job) {
+  // The seq_cst decrement pairs with the blocked_submitters increment in
+  // thread_pool_wait_for_space.
+  atomic_fetch_sub(&tpool->pending_jobs, 1);
+  if (atomic_load(&tpool->blocked_submitters) > 0) {
+    pthread_mutex_lock(&tpool->sleep_lock);
+    pthread_cond_signal(&tpool->space_available);
+    pthread_mutex_unlock(&tpool->sleep_lock);
+  }
+
+  thread_pool_counters_t *counters = thread_pool_counters(tpool);
+  atomic_fetch_add_explicit(&counters->jobs, 1, memory_order_relaxed);
+  if (job->enqueued_ns != 0) {
+    long wait = now_ns() - job->enqueued_ns;
+    int bucket = wait > 1 ? 63 - __builtin_clzl(wait) : 0;
+    if (bucket >= THREAD_POOL_WAIT_BUCKETS)
+      bucket = THREAD_POOL_WAIT_BUCKETS - 1;
+    atomic_fetch_add_explicit(&counters->queue_wait[bucket], 1, memory_order_relaxed);
+  }
+
+  thread_pool_call_job(job);
+  thread_pool_finish_job(tpool);
+}
+
+/* Runs one queued job on the calling thread, which may or may not be one of
+   the pool's workers. Used by threads waiting on a parallel_for so they keep
+   the pool busy instead of blocking it.
+   Returns whether a job was found. */
+static bool thread_pool_help(thread_pool_t *tpool) {
+  thread_pool_worker_t *worker = current_worker;
+  thread_pool_job_t job;
+
+  if (worker != NULL && worker->tpool != tpool)
+    worker = NULL;
+
+  if (!thread_pool_find_job(tpool, worker, &job))
     return false;
+
+  thread_pool_run_job(tpool, &job);
+  return true;
+}
+
+/* Looks for a job to run on behalf of the given worker (or of a thread outside
+   the pool if worker is NULL): first on the high priority queue, then on the
+   worker's own deque, then on the normal queue, and finally by stealing from
+   another worker's deque. Returns whether a job was found. */
+static bool thread_pool_find_job(thread_pool_t *tpool, thread_pool_worker_t *worker, thread_pool_job_t *job) {
+  for (int p = THREAD_POOL_PRIORITIES - 1; p > THREAD_POOL_PRIORITY_NORMAL; p--) {
+    thread_pool_queue_t *queue = &tpool->queues[p];
+    if (atomic_load_explicit(&queue->size, memory_order_relaxed) > 0 && thread_pool_pop_job(tpool, queue, job))
+      return true;
+  }
+
+  thread_pool_queue_t *normal = &tpool->queues[THREAD_POOL_PRIORITY_NORMAL];
+  if (tpool->backend != THREAD_POOL_WORK_STEALING)
+    return thread_pool_pop_job(tpool, normal, job);
+
+  if (worker != NULL) {
+    if (deque_take(&worker->deque, job))
+      return true;
+    if (thread_pool_pop_batch(worker, job) > 0)
+      return true;
+  } else if (thread_pool_pop_job(tpool, normal, job)) {
+    return true;
+  }
+
+  // Tries every other worker once, starting from a random victim.
+  u_int32_t *rand_state = worker != NULL ? &worker->rand_state : &helper_rand_state;
+  *rand_state = *rand_state * 1103515245u + 12345u;
+  u_int32_t start = (*rand_state >> 16) % tpool->max_threads;
+  for (u_int32_t n = 0; n < tpool->max_threads; n++) {
+    thread_pool_worker_t *victim = &tpool->workers[(start + n) % tpool->max_threads];
+    if (victim != worker && deque_steal(&victim->deque, job)) {
+      atomic_fetch_add_explicit(&thread_pool_counters(tpool)->steals, 1, memory_order_relaxed);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Puts the calling worker to sleep until a job is submitted or the pool shuts
+   down. If jobs are queued but were not found (e.g. a steal lost a race), the
+   worker yields and searches again instead of sleeping. Either way the time
+   spent counts as idle. */
+static void thread_pool_wait_for_work(thread_pool_t *tpool) {
+  thread_pool_counters_t *counters = &current_worker->counters;
+  long start = now_ns();
+  atomic_store_explicit(&counters->idle_since, start, memory_order_relaxed);
+
+  if (atomic_load(&tpool->pending_jobs) > 0) {
+    sched_yield();
+  } else {
+    pthread_mutex_lock(&tpool->sleep_lock);
+    atomic_fetch_add(&tpool->sleeping_workers, 1);
+
+    while (atomic_load(&tpool->pending_jobs) <= 0 && !atomic_load(&tpool->shutdown))
+      pthread_cond_wait(&tpool->work_available, &tpool->sleep_lock);
+
+    atomic_fetch_sub(&tpool->sleeping_workers, 1);
+    pthread_mutex_unlock(&tpool->sleep_lock);
+  }
+
+  atomic_fetch_add_explicit(&counters->idle_ns, now_ns() - start, memory_order_relaxed);
+  atomic_store_explicit(&counters->idle_since, 0, memory_order_relaxed);
+}
+
+static long now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void counters_init(thread_pool_counters_t *counters) {
+  atomic_init(&counters->jobs, 0);
+  atomic_init(&counters->idle_ns, 0);
+  atomic_init(&counters->idle_since, 0);
+  atomic_init(&counters->lock_waits, 0);
+  atomic_init(&counters->steals, 0);
+  for (int b = 0; b < THREAD_POOL_WAIT_BUCKETS; b++)
+    atomic_init(&counters->queue_wait[b], 0);
+}
+
+/* Returns the counters the calling thread should update for this pool. */
+static thread_pool_counters_t *thread_pool_counters(thread_pool_t *tpool) {
+  thread_pool_worker_t *worker = current_worker;
+  return worker != NULL && worker->tpool == tpool ? &worker->counters : tpool->external_counters;
+}
+
+/* Locks one of the pool's queue locks, counting a lock wait if it was taken. */
+static void lock_counted(thread_pool_t *tpool, pthread_mutex_t *lock) {
+  if (pthread_mutex_trylock(lock) == 0)
+    return;
+  atomic_fetch_add_explicit(&thread_pool_counters(tpool)->lock_waits, 1, memory_order_relaxed);
+  pthread_mutex_lock(lock);
+}
+
+/* Reads live counters into stats. A worker counts as busy for the part of
+   its lifetime_ns not spent waiting for work, including any wait in progress;
+   threads outside the pool (lifetime_ns 0) report neither. */
+static void worker_stats(thread_pool_counters_t *counters, long lifetime_ns, long now,
+                         thread_pool_worker_stats_t *stats) {
+  long idle_since = atomic_load_explicit(&counters->idle_since, memory_order_relaxed);
+  long idle = atomic_load_explicit(&counters->idle_ns, memory_order_relaxed);
+  if (idle_since != 0)
+    idle += now - idle_since;
+
+  stats->jobs = atomic_load_explicit(&counters->jobs, memory_order_relaxed);
+  stats->idle_ns = lifetime_ns > 0 ? idle : 0;
+  stats->busy_ns = lifetime_ns > idle ? lifetime_ns - idle : 0;
+  stats->lock_waits = atomic_load_explicit(&counters->lock_waits, memory_order_relaxed);
+  stats->steals = atomic_load_explicit(&counters->steals, memory_order_relaxed);
+}
+
+/* Marks one submitted job as finished, waking any thread_pool_wait_idle
+   callers once there is nothing left to run. */
+static void thread_pool_finish_job(thread_pool_t *tpool) {
+  if (atomic_fetch_sub(&tpool->unfinished_jobs, 1) == 1) {
+    pthread_mutex_lock(&tpool->sleep_lock);
+    pthread_cond_broadcast(&tpool->idle);
+    pthread_mutex_unlock(&tpool->sleep_lock);
+  }
+}
+
+/* Processes all chunks of a parallel_for call and waits for them to finish,
+   helping with other queued jobs in the meantime. */
+static void parallel_for_run(parallel_for_call_t *call, long chunks) {
+  call->priority = current_priority;
+  call->token = current_token;
+  call->done = false;
+  atomic_init(&call->remaining_chunks, chunks);
+  pthread_mutex_init(&call->done_lock, NULL);
+  pthread_cond_init(&call->done_cond, NULL);
+
+  parallel_for_chunks(call, 0, chunks);
+
+  while (atomic_load(&call->remaining_chunks) > 0 && thread_pool_help(call->tpool))
+    ;
+
+  // Always synchronises on done_lock, so that the last chunk has released it
+  // before the call state goes out of scope.
+  pthread_mutex_lock(&call->done_lock);
+  while (!call->done)
+    pthread_cond_wait(&call->done_cond, &call->done_lock);
+  pthread_mutex_unlock(&call->done_lock);
+
+  pthread_cond_destroy(&call->done_cond);
+  pthread_mutex_destroy(&call->done_lock);
+}
+
+/* Processes chunks [first, end): the upper half is repeatedly split off as a
+   job for other workers to pick up, until only chunk first is left to run.
+   Once the call is cancelled the chunks are counted as done without running. */
+static void parallel_for_chunks(parallel_for_call_t *call, long first, long end) {
+  long processed = end - first;
+
+  if (!thread_pool_cancelled(call->token)) {
+    // The splits carry no token of their own, as a dropped split would never
+    // count its chunks as done; they check call->token here instead.
+    thread_pool_job_opts_t opts = { call->priority, NULL };
+    while (end - first > 1) {
+      long mid = first + (end - first) / 2;
+      parallel_for_split_t split = { call, mid, end };
+      thread_pool_submit_job_copy_opts(call->tpool, &parallel_for_job, &split, sizeof(split), &opts);
+      end = mid;
+    }
+
+    call->run_chunk(call, first);
+    processed = 1;
+  }
+
+  if (atomic_fetch_sub(&call->remaining_chunks, processed) == processed) {
+    pthread_mutex_lock(&call->done_lock);
+    call->done = true;
+    pthread_cond_signal(&call->done_cond);
+    pthread_mutex_unlock(&call->done_lock);
   }
+}
+
+static void *parallel_for_job(void *vsplit) {
+  parallel_for_split_t *split = (parallel_for_split_t *) vsplit;
+
+  current_token = split->call->token;
+  parallel_for_chunks(split->call, split->first, split->end);
+  return NULL;
+}
+
+static void parallel_for_range_chunk(parallel_for_call_t *call, long chunk) {
+  long begin = call->begin + chunk * call->grain;
+  long end = begin + call->grain < call->end ? begin + call->grain : call->end;
+
+  call->range_fn(call->ctx, begin, end);
+}
+
+static void parallel_for_tile_chunk(parallel_for_call_t *call, long chunk) {
+  long x0 = call->begin + (chunk % call->tiles_x) * call->grain;
+  long y0 = call->y_begin + (chunk / call->tiles_x) * call->grain_y;
+  long x1 = x0 + call->grain < call->end ? x0 + call->grain : call->end;
+  long y1 = y0 + call->grain_y < call->y_end ? y0 + call->grain_y : call->y_end;
+
+  call->tile_fn(call->ctx, x0, x1, y0, y1);
+}
+
+/* Records that one of the future's dependencies has finished, submitting the
+   future's job once none are left. */
+static void future_dep_met(thread_pool_future_t *future) {
+  // As with parallel_for splits, the future checks its token itself so that
+  // it is completed even when its job is skipped.
+  thread_pool_job_opts_t opts = { future->priority, NULL };
+  if (atomic_fetch_sub(&future->unmet_deps, 1) == 1)
+    thread_pool_submit_job_opts(future->tpool, &future_run_job, future, &opts);
+}
+
+/* Runs a future's job unless it has been cancelled, then wakes its waiters
+   and releases its dependents. Dependents are queued before this job counts
+   as finished, so thread_pool_wait_idle also waits for whole dependency chains. */
+static void *future_run_job(void *vfuture) {
+  thread_pool_future_t *future = (thread_pool_future_t *) vfuture;
+
+  if (thread_pool_cancelled(future->token)) {
+    atomic_store(&future->cancelled, true);
+  } else {
+    current_token = future->token;
+    future->result = future->job(future->args);
+  }
+
+  pthread_mutex_lock(&future->lock);
+  atomic_store(&future->done, true);
+  future_dependent_t *dependents = future->dependents;
+  future->dependents = NULL;
+  pthread_cond_broadcast(&future->done_cond);
+  pthread_mutex_unlock(&future->lock);
+
+  while (dependents != NULL) {
+    future_dependent_t *next = dependents->next;
+    future_dep_met(dependents->future);
+    free(dependents);
+    dependents = next;
+  }
+
+  thread_pool_future_release(future);
+  return NULL;
+}
+
+/* Returns whether the pool holds at least high_water queued jobs. */
+static bool thread_pool_over_high_water(thread_pool_t *tpool) {
+  return tpool->high_water > 0 && atomic_load(&tpool->pending_jobs) >= tpool->high_water;
+}
 
-  tpool->job_q[tpool->q_size] = job;
-  tpool->q_size++;
+/* Blocks the submitting thread until the queued jobs drop below the
+   high-water mark. Returns false if the pool shuts down in the meantime. */
+static bool thread_pool_wait_for_space(thread_pool_t *tpool) {
+  pthread_mutex_lock(&tpool->sleep_lock);
+  atomic_fetch_add(&tpool->blocked_submitters, 1);
 
-  pthread_mutex_unlock(&tpool->q_lock);
+  while (thread_pool_over_high_water(tpool) && !atomic_load(&tpool->shutdown))
+    pthread_cond_wait(&tpool->space_available, &tpool->sleep_lock);
+
+  atomic_fetch_sub(&tpool->blocked_submitters, 1);
+  bool running = !atomic_load(&tpool->shutdown);
+  pthread_mutex_unlock(&tpool->sleep_lock);
+  return running;
+}
+
+/* Initialises a shared queue, backed by a ring of ring_capacity jobs (a power
+   of two) if that is not 0. */
+static void queue_init(thread_pool_queue_t *queue, u_int32_t ring_capacity) {
+  queue->ring = ring_capacity > 0 ? ring_new(ring_capacity) : NULL;
+  atomic_init(&queue->spare_seg, NULL);
+  atomic_init(&queue->size, 0);
+  queue->head_seg = segment_new(queue);
+  queue->tail_seg = queue->head_seg;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_mutex_init(&queue->tail_lock, NULL);
+}
+
+static void queue_destroy(thread_pool_queue_t *queue) {
+  thread_pool_segment_t *seg = queue->head_seg;
+  while (seg != NULL) {
+    thread_pool_segment_t *next = atomic_load(&seg->next);
+    free(seg);
+    seg = next;
+  }
+  free(atomic_load(&queue->spare_seg));
+  free(queue->ring);
+  pthread_mutex_destroy(&queue->tail_lock);
+  pthread_mutex_destroy(&queue->lock);
+}
+
+/* Pushes a job onto the back of a shared queue, chaining on a new segment
+   when the tail segment is full. Only producers take tail_lock, so pushes
+   never wait on workers popping from the front.
+   Returns whether the job was pushed, which fails only if the ring is full. */
+static bool thread_pool_push_job(thread_pool_t *tpool, thread_pool_queue_t *queue, thread_pool_job_t job) {
+  if (queue->ring != NULL)
+    return ring_push(queue->ring, &job);
+
+  lock_counted(tpool, &queue->tail_lock);
+
+  thread_pool_segment_t *seg = queue->tail_seg;
+  u_int32_t tail = atomic_load_explicit(&seg->tail, memory_order_relaxed);
+  if (tail == SEGMENT_JOBS) {
+    thread_pool_segment_t *next = segment_new(queue);
+    atomic_store_explicit(&seg->next, next, memory_order_release);
+    queue->tail_seg = next;
+    seg = next;
+    tail = 0;
+  }
+
+  seg->jobs[tail] = job;
+  atomic_store_explicit(&seg->tail, tail + 1, memory_order_release);
+  atomic_fetch_add(&queue->size, 1);
+
+  pthread_mutex_unlock(&queue->tail_lock);
   return true;
 }
 
-/* Atomically pops a job out of the thread pool's queue.
-   If there are no jobs, then this returns null. Otherwise, a pointer
-   to the popped job is returned. */
-static thread_pool_job_t *thread_pool_pop_job(thread_pool_t *tpool) {
-  pthread_mutex_lock(&tpool->q_lock);
+/* Atomically pops a job off the front of a shared queue into job.
+   Returns whether there was a job to pop. */
+static bool thread_pool_pop_job(thread_pool_t *tpool, thread_pool_queue_t *queue, thread_pool_job_t *job) {
+  if (queue->ring != NULL)
+    return ring_pop(queue->ring, job);
+
+  lock_counted(tpool, &queue->lock);
+  bool popped = thread_pool_pop_job_locked(queue, job);
+  pthread_mutex_unlock(&queue->lock);
+  return popped;
+}
+
+/* Pops a job off the front of a shared queue while holding its lock. A
+   drained segment is kept as the spare for the next one the producers need. */
+static bool thread_pool_pop_job_locked(thread_pool_queue_t *queue, thread_pool_job_t *job) {
+  thread_pool_segment_t *seg = queue->head_seg;
 
-  if (tpool->q_size == 0) {
-    pthread_mutex_unlock(&tpool->q_lock);
-    return NULL;
+  if (seg->head == SEGMENT_JOBS) {
+    thread_pool_segment_t *next = atomic_load_explicit(&seg->next, memory_order_acquire);
+    if (next == NULL)
+      return false;
+    queue->head_seg = next;
+    free(atomic_exchange(&queue->spare_seg, seg));
+    seg = next;
   }
 
-  tpool->q_size--;
-  thread_pool_job_t *job = tpool->job_q + tpool->q_size;
+  if (seg->head == atomic_load_explicit(&seg->tail, memory_order_acquire))
+    return false;
+
+  *job = seg->jobs[seg->head];
+  seg->head++;
+  atomic_fetch_sub(&queue->size, 1);
+  return true;
+}
+
+/* Moves a fair share of the normal priority queue onto the worker's deque
+   under a single lock acquisition, so that other workers can steal it from
+   there. The first job taken is returned in job rather than pushed.
+   Returns the number of jobs taken off the shared queue. */
+static u_int32_t thread_pool_pop_batch(thread_pool_worker_t *worker, thread_pool_job_t *job) {
+  thread_pool_t *tpool = worker->tpool;
+  thread_pool_queue_t *queue = &tpool->queues[THREAD_POOL_PRIORITY_NORMAL];
+  long queued = atomic_load(&queue->size);
+
+  if (queued <= 0)
+    return 0;
+
+  long batch = queued / tpool->max_threads + 1;
+  if (batch > INJECTOR_MAX_BATCH)
+    batch = INJECTOR_MAX_BATCH;
+
+  lock_counted(tpool, &queue->lock);
+
+  u_int32_t taken = 0;
+  thread_pool_job_t next;
+  while (taken < batch && thread_pool_pop_job_locked(queue, &next)) {
+    if (taken == 0)
+      *job = next;
+    else
+      deque_push(&worker->deque, next);
+    taken++;
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+  return taken;
+}
+
+/* Returns an empty queue segment, reusing the queue's spare one when available. */
+static thread_pool_segment_t *segment_new(thread_pool_queue_t *queue) {
+  thread_pool_segment_t *seg = atomic_exchange(&queue->spare_seg, NULL);
+  if (seg == NULL)
+    seg = malloc(sizeof(thread_pool_segment_t));
+
+  atomic_init(&seg->next, NULL);
+  atomic_init(&seg->tail, 0);
+  seg->head = 0;
+  return seg;
+}
+
+/* Returns an empty ring holding capacity jobs, which must be a power of two. */
+static thread_pool_ring_t *ring_new(u_int32_t capacity) {
+  size_t size = sizeof(thread_pool_ring_t) + capacity * sizeof(thread_pool_ring_slot_t);
+  // aligned_alloc wants a whole number of alignment units
+  thread_pool_ring_t *ring = aligned_alloc(CACHE_LINE, (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+  ring->mask = capacity - 1;
+  atomic_init(&ring->enqueue_pos, 0);
+  atomic_init(&ring->dequeue_pos, 0);
+  for (u_int32_t i = 0; i < capacity; i++)
+    atomic_init(&ring->slots[i].seq, i);
+  return ring;
+}
+
+/* Claims the next enqueue position and publishes the job in its slot.
+   Returns false if the ring is full. */
+static bool ring_push(thread_pool_ring_t *ring, thread_pool_job_t *job) {
+  unsigned long pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+  thread_pool_ring_slot_t *slot;
+
+  for (;;) {
+    slot = &ring->slots[pos & ring->mask];
+    unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    long diff = (long) (seq - pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // The slot still holds the job from one lap ago.
+      return false;
+    } else {
+      pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  slot->job = *job;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  return true;
+}
 
-  pthread_mutex_unlock(&tpool->q_lock);
-  return job;
-}
\ No newline at end of file
+/* Claims the next dequeue position and takes the job from its slot, freeing
+   the slot for the producer one lap ahead. Returns false if the ring is empty. */
+static bool ring_pop(thread_pool_ring_t *ring, thread_pool_job_t *job) {
+  unsigned long pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+  thread_pool_ring_slot_t *slot;
+
+  for (;;) {
+    slot = &ring->slots[pos & ring->mask];
+    unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    long diff = (long) (seq - (pos + 1));
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // The slot's job has not been published yet.
+      return false;
+    } else {
+      pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    }
+  }
+
+  *job = slot->job;
+  atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+  return true;
+}
+
+/* Deque slots are written and read one word at a time with relaxed atomics:
+   a thief may copy a slot while the owner reuses it, and only the CAS on top
+   that follows tells it whether the copy is a job or to be discarded. */
+#define DEQUE_SLOT_WORDS (sizeof(thread_pool_job_t) / sizeof(unsigned long))
+_Static_assert(sizeof(thread_pool_job_t) % sizeof(unsigned long) == 0, "deque slots are copied in whole words");
+
+static void deque_slot_store(thread_pool_job_t *slot, const thread_pool_job_t *job) {
+  unsigned long words[DEQUE_SLOT_WORDS];
+  memcpy(words, job, sizeof(words));
+  for (size_t i = 0; i < DEQUE_SLOT_WORDS; i++)
+    atomic_store_explicit((atomic_ulong *) slot + i, words[i], memory_order_relaxed);
+}
+
+static void deque_slot_load(thread_pool_job_t *job, thread_pool_job_t *slot) {
+  unsigned long words[DEQUE_SLOT_WORDS];
+  for (size_t i = 0; i < DEQUE_SLOT_WORDS; i++)
+    words[i] = atomic_load_explicit((atomic_ulong *) slot + i, memory_order_relaxed);
+  memcpy(job, words, sizeof(words));
+}
+
+static thread_pool_deque_buf_t *deque_buf_new(long size) {
+  thread_pool_deque_buf_t *buf = malloc(sizeof(thread_pool_deque_buf_t) + size * sizeof(thread_pool_job_t));
+  buf->size = size;
+  buf->retired = NULL;
+  return buf;
+}
+
+static void deque_init(thread_pool_deque_t *deque) {
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  atomic_init(&deque->buf, deque_buf_new(DEQUE_INITIAL_SIZE));
+}
+
+static void deque_destroy(thread_pool_deque_t *deque) {
+  thread_pool_deque_buf_t *buf = atomic_load_explicit(&deque->buf, memory_order_relaxed);
+  while (buf != NULL) {
+    thread_pool_deque_buf_t *retired = buf->retired;
+    free(buf);
+    buf = retired;
+  }
+}
+
+/* Pushes a job onto the bottom of the deque, doubling its buffer when full.
+   Only ever called by the deque's owner. */
+static void deque_push(thread_pool_deque_t *deque, thread_pool_job_t job) {
+  long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+  thread_pool_deque_buf_t *buf = atomic_load_explicit(&deque->buf, memory_order_relaxed);
+
+  if (b - t > buf->size - 1) {
+    thread_pool_deque_buf_t *grown = deque_buf_new(buf->size * 2);
+    for (long i = t; i < b; i++) {
+      thread_pool_job_t moved;
+      deque_slot_load(&moved, &buf->jobs[i & (buf->size - 1)]);
+      deque_slot_store(&grown->jobs[i & (grown->size - 1)], &moved);
+    }
+    grown->retired = buf;
+    atomic_store_explicit(&deque->buf, grown, memory_order_release);
+    buf = grown;
+  }
+
+  deque_slot_store(&buf->jobs[b & (buf->size - 1)], &job);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+}
+
+/* Takes the most recently pushed job off the bottom of the deque.
+   Only ever called by the deque's owner. Returns whether a job was taken. */
+static bool deque_take(thread_pool_deque_t *deque, thread_pool_job_t *job) {
+  long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  thread_pool_deque_buf_t *buf = atomic_load_explicit(&deque->buf, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (t > b) {
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return false;
+  }
+
+  deque_slot_load(job, &buf->jobs[b & (buf->size - 1)]);
+  if (t == b) {
+    // Last job left: race any thieves for it.
+    bool won = atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                       memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return won;
+  }
+  return true;
+}
+
+/* Steals the oldest job off the top of the deque. Called by any worker other
+   than the owner. A job copied from a slot the owner has since reused is
+   discarded because the following CAS on top fails (see deque_slot_load).
+   Returns whether a job was stolen. */
+static bool deque_steal(thread_pool_deque_t *deque, thread_pool_job_t *job) {
+  long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+  if (t >= b)
+    return false;
+
+  thread_pool_deque_buf_t *buf = atomic_load_explicit(&deque->buf, memory_order_acquire);
+  thread_pool_job_t stolen;
+  deque_slot_load(&stolen, &buf->jobs[t & (buf->size - 1)]);
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                               memory_order_seq_cst, memory_order_relaxed))
+    return false;
+
+  *job = stolen;
+  return true;
+}
@@ -1,19 +1,178 @@
-#ifndef THREAD_POOL_H 
+#ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+// argument bytes thread_pool_submit_job_copy can store inside a job
+#define THREAD_POOL_INLINE_ARGS 48
+// number of thread_pool_priority_t levels, each with its own shared queue
+#define THREAD_POOL_PRIORITIES 2
+// log2 buckets of the queue-wait histogram, the last one open-ended
+#define THREAD_POOL_WAIT_BUCKETS 32
+// one in this many queued jobs has its queue wait recorded
+#define THREAD_POOL_WAIT_SAMPLE 16
+
+/* Scheduling strategies a thread pool can be initialised with. */
+typedef enum thread_pool_backend {
+  // every worker pops from the shared queues, each guarded by its lock
+  THREAD_POOL_MUTEX_QUEUE,
+  // every worker owns a Chase-Lev deque and steals from the others when idle
+  THREAD_POOL_WORK_STEALING,
+  // every worker pops from a bounded lock-free ring of sequence-numbered slots
+  THREAD_POOL_MPMC_RING
+} thread_pool_backend_t;
+
+/* What a submitter does when the pool already holds high_water queued jobs. */
+typedef enum thread_pool_overflow {
+  // wait until the workers have brought the queue back under the mark
+  THREAD_POOL_OVERFLOW_BLOCK,
+  // run the job on the submitting thread
+  THREAD_POOL_OVERFLOW_RUN_INLINE
+} thread_pool_overflow_t;
+
+/* How a pool's worker threads are pinned to CPUs. */
+typedef enum thread_pool_affinity {
+  // workers may run on any CPU the process may use
+  THREAD_POOL_PIN_NONE,
+  // each worker is pinned to its own CPU
+  THREAD_POOL_PIN_CORES,
+  // each worker is pinned to the CPUs of one NUMA node
+  THREAD_POOL_PIN_NUMA
+} thread_pool_affinity_t;
+
+/* Scheduling priority of a job. Workers always look for high priority jobs
+   first, and high priority submitters are never throttled at the high-water mark. */
+typedef enum thread_pool_priority {
+  THREAD_POOL_PRIORITY_NORMAL,
+  THREAD_POOL_PRIORITY_HIGH
+} thread_pool_priority_t;
+
+/* Flag shared by a group of jobs so that they can be abandoned together. */
+typedef struct thread_pool_cancel_token {
+  atomic_bool cancelled;
+} thread_pool_cancel_token_t;
+
+/* Options for the thread_pool_submit*_opts functions. Passing NULL options
+   makes the job inherit the priority and token of the job submitting it. */
+typedef struct thread_pool_job_opts {
+  thread_pool_priority_t priority;
+  // token whose cancellation drops the job if it has not started (may be NULL)
+  thread_pool_cancel_token_t *token;
+} thread_pool_job_opts_t;
+
+/* Counters of one worker thread, as reported by thread_pool_stats. */
+typedef struct thread_pool_worker_stats {
+  long jobs;
+  // time not spent waiting for work, and time spent waiting for it
+  long busy_ns;
+  long idle_ns;
+  // times a queue lock was found taken and had to be waited for
+  long lock_waits;
+  // jobs taken off another worker's deque
+  long steals;
+} thread_pool_worker_stats_t;
+
+/* Snapshot of a pool's counters since it was initialised. */
+typedef struct thread_pool_stats {
+  thread_pool_backend_t backend;
+  // jobs run, and locks waited for, by threads outside the pool helping it
+  thread_pool_worker_stats_t external;
+  // sampled jobs that sat in a queue for [2^i, 2^(i+1)) ns before starting
+  long queue_wait[THREAD_POOL_WAIT_BUCKETS];
+  u_int32_t num_workers;
+  thread_pool_worker_stats_t workers[];
+} thread_pool_stats_t;
+
+/* Handle on a job submitted with thread_pool_submit. */
+typedef struct thread_pool_future thread_pool_future_t;
+
+/* Body of a parallel_for: processes iterations [begin, end). */
+typedef void thread_pool_range_fn(void *ctx, long begin, long end);
+
+/* Body of a parallel_for_2d: processes the tile [x0, x1) x [y0, y1). */
+typedef void thread_pool_tile_fn(void *ctx, long x0, long x1, long y0, long y1);
+
+/* Shared job queue: a linked list of fixed-size segments, grown on demand,
+   with consumers serialised by lock and producers by tail_lock, or a bounded
+   lock-free ring when ring is set. */
+typedef struct thread_pool_queue {
+  struct thread_pool_ring *ring;
+  struct thread_pool_segment *head_seg;
+  struct thread_pool_segment *tail_seg;
+  _Atomic(struct thread_pool_segment *) spare_seg;
+  // jobs in the segments (not maintained for a ring)
+  atomic_long size;
+  pthread_mutex_t lock;
+  pthread_mutex_t tail_lock;
+} thread_pool_queue_t;
+
 typedef struct thread_pool {
+  thread_pool_backend_t backend;
   u_int32_t max_threads;
-  u_int32_t capacity;
-  u_int32_t q_size;
-  struct thread_pool_job *job_q;
-  pthread_mutex_t q_lock;
+  // queued jobs at which submitters are throttled (0 for no limit)
+  u_int32_t high_water;
+  thread_pool_overflow_t overflow;
+  thread_pool_affinity_t affinity;
+  // one shared queue per priority level
+  thread_pool_queue_t queues[THREAD_POOL_PRIORITIES];
+  struct thread_pool_worker *workers;
+  // counters of the threads outside the pool
+  struct thread_pool_counters *external_counters;
+  // jobs sitting in a queue or deque, and jobs submitted but not yet finished
+  atomic_long pending_jobs;
+  atomic_long unfinished_jobs;
+  atomic_int sleeping_workers;
+  atomic_int blocked_submitters;
+  atomic_bool shutdown;
+  atomic_bool count_allocs;
+  atomic_long avoided_allocs;
+  pthread_mutex_t sleep_lock;
+  pthread_cond_t work_available;
+  pthread_cond_t space_available;
+  pthread_cond_t idle;
 } thread_pool_t;
 
-void thread_pool_init(thread_pool_t *tpool, u_int32_t max_threads, u_int32_t capacity);
+void thread_pool_init(thread_pool_t *tpool, u_int32_t max_threads, u_int32_t high_water);
+void thread_pool_init_backend(thread_pool_t *tpool, u_int32_t max_threads, u_int32_t high_water,
+                              thread_pool_backend_t backend);
+void thread_pool_set_overflow(thread_pool_t *tpool, thread_pool_overflow_t overflow);
+void thread_pool_set_affinity(thread_pool_t *tpool, thread_pool_affinity_t affinity);
+u_int32_t thread_pool_default_threads(void);
+thread_pool_affinity_t thread_pool_default_affinity(void);
 bool thread_pool_submit_job(thread_pool_t *tpool, void *(* job)(void *), void *args);
-void thread_pool_run_and_wait(thread_pool_t *tpool);
+bool thread_pool_submit_job_copy(thread_pool_t *tpool, void *(* job)(void *), const void *args, size_t size);
+bool thread_pool_submit_job_opts(thread_pool_t *tpool, void *(* job)(void *), void *args,
+                                 const thread_pool_job_opts_t *opts);
+bool thread_pool_submit_job_copy_opts(thread_pool_t *tpool, void *(* job)(void *), const void *args, size_t size,
+                                      const thread_pool_job_opts_t *opts);
+void thread_pool_set_alloc_counting(thread_pool_t *tpool, bool enabled);
+long thread_pool_avoided_allocs(thread_pool_t *tpool);
+thread_pool_future_t *thread_pool_submit(thread_pool_t *tpool, void *(* job)(void *), void *args,
+                                         thread_pool_future_t **deps, u_int32_t num_deps);
+thread_pool_future_t *thread_pool_submit_opts(thread_pool_t *tpool, void *(* job)(void *), void *args,
+                                              thread_pool_future_t **deps, u_int32_t num_deps,
+                                              const thread_pool_job_opts_t *opts);
+bool thread_pool_future_done(thread_pool_future_t *future);
+bool thread_pool_future_cancelled(thread_pool_future_t *future);
+void *thread_pool_future_wait(thread_pool_future_t *future);
+void thread_pool_future_release(thread_pool_future_t *future);
+void thread_pool_cancel_token_init(thread_pool_cancel_token_t *token);
+void thread_pool_cancel(thread_pool_cancel_token_t *token);
+bool thread_pool_cancelled(thread_pool_cancel_token_t *token);
+bool thread_pool_cancel_requested(void);
+thread_pool_stats_t *thread_pool_stats(thread_pool_t *tpool);
+void thread_pool_stats_json(FILE *file, const thread_pool_stats_t *stats);
+void thread_pool_wait_idle(thread_pool_t *tpool);
 void thread_pool_destroy(thread_pool_t *tpool);
+long thread_pool_auto_grain(thread_pool_t *tpool, long n, long min_grain);
+void thread_pool_parallel_for(thread_pool_t *tpool, long begin, long end, long grain,
+                              thread_pool_range_fn *fn, void *ctx);
+void thread_pool_parallel_for_2d(thread_pool_t *tpool, long x_begin, long x_end, long y_begin, long y_end,
+                                 long grain_x, long grain_y, thread_pool_tile_fn *fn, void *ctx);
+const char *thread_pool_backend_name(thread_pool_backend_t backend);
 
-#endif
\ No newline at end of file
+#endif
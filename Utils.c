@@ -35,6 +35,24 @@
     return true;
   }
 
+  bool save_pixels(const uint8_t *pixels, int width, int height, const char *path){
+    int ret = sod_img_blob_save_as_jpeg(path, pixels, width, height, FULL_COLOUR_CHANNELS,
+                                        DEFAULT_COMPRESSION_QUALITY);
+    if(ret != SOD_OK){
+      printf("[!] error saving file to %s\n", path);
+      return false;
+    }
+    return true;
+  }
+
+  uint8_t *image_to_pixels(sod_img img){
+    return sod_image_to_blob(img);
+  }
+
+  void free_pixels(uint8_t *pixels){
+    sod_image_free_blob(pixels);
+  }
+
   sod_img copy_image(sod_img img){
     return sod_copy_image(img);   
   }
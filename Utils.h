@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "sod_118/sod.h"
 
   #define IO_ERROR -1
@@ -21,6 +22,16 @@
   
   // Saves the given image in the given destination.
   bool save_image(sod_img img, const char *path);
+
+  // Saves width x height interleaved 8-bit RGB pixels in the given destination.
+  bool save_pixels(const uint8_t *pixels, int width, int height, const char *path);
+
+  // Converts the image to newly allocated interleaved 8-bit RGB pixels,
+  // exactly as saving it would (release them with free_pixels)
+  uint8_t *image_to_pixels(sod_img img);
+
+  // Free the memory used by pixels provided as argument
+  void free_pixels(uint8_t *pixels);
     
   // Clones the image provided as argument
   sod_img copy_image(sod_img img);
@@ -112,6 +112,7 @@ else
   run_test("load_test","",[],[],["funny_name"]) #load
   run_test("unload_test","test_images/ducks2.jpg test_images/ducks1.jpg test_images/test.jpg",[],[],["ducks1\n"],["ducks2\n"]) #unload
   run_test("save_test","test_images/some_ducks.jpg",["a_random_test_name.jpg"],["a_random_test_name.jpeg"]) #save  
+  run_test("bad_arguments","test_images/test.jpg",["test_rotate_90.jpg"],["test_rotate_90.jpeg"],["angle 45", "plane D"]) #rotate/flip argument errors
     
   # basic "sequential" transformation tests:
   run_test("test_invert", "test_images/test.jpg", ["test_inverted.jpg"], ["test_inverted.jpeg"])
@@ -167,6 +168,20 @@ else
   end
   puts ""
 
+  # store stress test (liststore snapshots against a load/unload storm):
+  puts "> running: picstore_stress"
+  puts "--------------------------------------"
+  stress_output = %x(./picstore_stress 2>&1)
+  puts stress_output
+  if($?.exitstatus == 0) then
+    puts "  + store stayed consistent under the storm"
+    @testscores << {"score": 1, "name": "picstore_stress", "possible": 1}
+  else
+    puts "  - picture store stress test failed"
+    @testscores << {"score": 0, "name": "picstore_stress", "possible": 1}
+  end
+  puts ""
+
 
   # full integration tests (more realistic inputs):
   puts "------------------------------"
@@ -111,6 +111,26 @@ else
     run_test("repeated blur test #{blur_cnt}", "par-need_glasses#{blur_cnt-1}.jpg par-need_glasses#{blur_cnt}.jpg parallel-blur", "need_glasses#{blur_cnt}.jpeg")  
   end
   
+  # pixel span accessors, checked against single pixel access:
+  puts "----------------------------------------"
+  puts "       Pixel Accessor Test Cases        " 
+  puts "----------------------------------------"
+  puts ""
+
+  ["test.jpg", "keep_calm.jpg", "dip.jpg"].each do |image|
+    test_name = "pixel span test (#{image})"
+    puts "> running: #{test_name}"
+    system %Q(./picture_span_check test_images/#{image} 2>&1)
+    if($?.exitstatus == 0) then
+      puts "  + pixel spans match single pixels"
+      @testscores << {"score": 1, "name": "#{test_name}", "possible": 1}
+    else
+      puts "  - pixel span check failed"
+      @testscores << {"score": 0, "name": "#{test_name}", "possible": 1}
+    end
+    puts ""
+  end
+
   puts "----------------------------------------"
   puts "           IO ERROR Test Cases          " 
   puts "----------------------------------------"